@@ -0,0 +1,466 @@
+/**************************** AAC encoder library ******************************
+
+   Description: Pool of preconfigured encoder instances for services that open
+                and close many short-lived streams.
+
+*******************************************************************************/
+
+/**
+ * \file   aacenc_pool.h
+ * \brief  Warm AAC encoder instance pool.
+ *
+ * aacEncOpen() allocates all encoder modules, and the first aacEncEncode()
+ * after configuration builds the filterbank, psychoacoustic and bitrate
+ * control setup. For an ingest service that starts and stops streams all
+ * the time, that setup dominates short streams.
+ *
+ * The pool keeps idle, fully initialized instances per configuration key
+ * (AOT, sampling rate, channel mode, bitrate and the few other parameters
+ * that force a full reconfiguration). When a stream ends its instance is
+ * reset with ::AACENC_INIT_STATES | ::AACENC_RESET_INBUFFER |
+ * ::AACENC_INIT_TRANSPORT: history buffers are cleared and the transport
+ * headers re-armed, but nothing is reallocated or rebuilt. The next stream
+ * with the same key gets it from a free list.
+ *
+ * aacEncPool_EncodeBatch() lets one worker thread drive many streams: each
+ * job's pending PCM is encoded on its own instance and every access unit is
+ * handed to a callback.
+ *
+ * All pool functions are thread-safe. An acquired stream belongs to one
+ * thread at a time.
+ */
+
+#ifndef AACENC_POOL_H
+#define AACENC_POOL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aacenc_lib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Configuration key. Instances are only reused for an identical key.
+ */
+typedef struct {
+  UINT aot;          /*!< ::AACENC_AOT, e.g. AOT_AAC_LC. */
+  UINT sampleRate;   /*!< ::AACENC_SAMPLERATE. */
+  UINT channelMode;  /*!< ::AACENC_CHANNELMODE, see ::CHANNEL_MODE. */
+  UINT bitrate;      /*!< ::AACENC_BITRATE, ignored when bitrateMode is VBR. */
+  UINT bitrateMode;  /*!< ::AACENC_BITRATEMODE, 0 for CBR. */
+  UINT transmux;     /*!< ::AACENC_TRANSMUX, e.g. TT_MP4_ADTS. */
+  UINT afterburner;  /*!< ::AACENC_AFTERBURNER. */
+} AACENC_POOL_KEY;
+
+/**
+ * Encoder instance handed out by aacEncPool_Acquire().
+ */
+typedef struct AACENC_POOL_STREAM {
+  HANDLE_AACENCODER hEncoder; /*!< Use with aacEncEncode() as usual. */
+  AACENC_InfoStruct info;     /*!< frameLength, confBuf (ASC), delay, ... */
+  AACENC_POOL_KEY key;
+  AACENC_POOL_KEY applied;    /*!< Keyed parameters as read back after setup. */
+  struct AACENC_POOL_STREAM *next;
+} AACENC_POOL_STREAM;
+
+typedef struct AACENC_POOL_BUCKET {
+  AACENC_POOL_KEY key;
+  AACENC_POOL_STREAM *idle;
+  INT nIdle;
+  struct AACENC_POOL_BUCKET *next;
+} AACENC_POOL_BUCKET;
+
+/**
+ * Pool statistics, see aacEncPool_GetStats().
+ */
+typedef struct {
+  UINT hits;    /*!< Acquires served by a warm instance. */
+  UINT misses;  /*!< Acquires that had to open and configure an instance. */
+  UINT resets;  /*!< Instances reset and put back on a free list. */
+  UINT evicted; /*!< Instances closed because the free list was full. */
+  UINT idle;    /*!< Warm instances currently pooled. */
+  UINT active;  /*!< Instances currently acquired. */
+} AACENC_POOL_STATS;
+
+typedef struct {
+  pthread_mutex_t lock;
+  AACENC_POOL_BUCKET *buckets;
+  INT maxIdlePerKey;
+  AACENC_POOL_STATS stats;
+} AACENC_POOL;
+
+typedef AACENC_POOL *HANDLE_AACENC_POOL;
+
+/**
+ * One unit of work for aacEncPool_EncodeBatch().
+ */
+typedef struct {
+  AACENC_POOL_STREAM *stream;
+  const SHORT *pcm;       /*!< Interleaved 16 bit PCM. */
+  INT numSamples;         /*!< Samples in pcm, all channels counted. */
+  INT flush;              /*!< Drain the encoder after pcm (end of stream). */
+  UCHAR *outBuf;          /*!< Scratch of at least info.maxOutBufBytes. */
+  INT outBufSize;
+  void (*onAccessUnit)(void *opaque, const UCHAR *au, INT size);
+  void *opaque;
+  INT samplesConsumed;    /*!< Out: input samples consumed. */
+  INT accessUnits;        /*!< Out: access units emitted. */
+  AACENC_ERROR err;       /*!< Out: AACENC_OK or the first failure. */
+} AACENC_POOL_JOB;
+
+static inline UINT aacEncPool_Channels(UINT channelMode) {
+  switch (channelMode) {
+    case MODE_1:
+    case MODE_2:
+    case MODE_1_2:
+    case MODE_1_2_1:
+    case MODE_1_2_2:
+    case MODE_1_2_2_1:
+      return channelMode;
+    case MODE_1_2_2_2_1:
+    case MODE_7_1_BACK:
+    case MODE_7_1_TOP_FRONT:
+    case MODE_7_1_REAR_SURROUND:
+    case MODE_7_1_FRONT_CENTER:
+      return 8;
+    case MODE_6_1:
+      return 7;
+    default:
+      return 0; /* let the library allocate the maximum */
+  }
+}
+
+static inline int aacEncPool_KeyEqual(const AACENC_POOL_KEY *a,
+                                      const AACENC_POOL_KEY *b) {
+  return a->aot == b->aot && a->sampleRate == b->sampleRate &&
+         a->channelMode == b->channelMode && a->bitrate == b->bitrate &&
+         a->bitrateMode == b->bitrateMode && a->transmux == b->transmux &&
+         a->afterburner == b->afterburner;
+}
+
+/* Read back the keyed parameters of an instance. */
+static inline void aacEncPool_GetKey(HANDLE_AACENCODER hEncoder,
+                                     AACENC_POOL_KEY *key) {
+  key->aot = aacEncoder_GetParam(hEncoder, AACENC_AOT);
+  key->sampleRate = aacEncoder_GetParam(hEncoder, AACENC_SAMPLERATE);
+  key->channelMode = aacEncoder_GetParam(hEncoder, AACENC_CHANNELMODE);
+  key->bitrate = aacEncoder_GetParam(hEncoder, AACENC_BITRATE);
+  key->bitrateMode = aacEncoder_GetParam(hEncoder, AACENC_BITRATEMODE);
+  key->transmux = aacEncoder_GetParam(hEncoder, AACENC_TRANSMUX);
+  key->afterburner = aacEncoder_GetParam(hEncoder, AACENC_AFTERBURNER);
+}
+
+/**
+ * \brief  Create an encoder pool.
+ *
+ * \param phPool         Pointer to a pool handle. Initialized on return.
+ * \param maxIdlePerKey  Warm instances kept per key, <= 0 for unlimited.
+ *
+ * \return  AACENC_OK or AACENC_MEMORY_ERROR.
+ */
+static inline AACENC_ERROR aacEncPool_Open(HANDLE_AACENC_POOL *phPool,
+                                           INT maxIdlePerKey) {
+  AACENC_POOL *pool = (AACENC_POOL *)calloc(1, sizeof(*pool));
+
+  *phPool = NULL;
+  if (pool == NULL) return AACENC_MEMORY_ERROR;
+  if (pthread_mutex_init(&pool->lock, NULL)) {
+    free(pool);
+    return AACENC_MEMORY_ERROR;
+  }
+  pool->maxIdlePerKey = maxIdlePerKey;
+  *phPool = pool;
+  return AACENC_OK;
+}
+
+/* Open and fully initialize a new instance for key. */
+static inline AACENC_ERROR aacEncPool_Create(const AACENC_POOL_KEY *key,
+                                             AACENC_POOL_STREAM **pStream) {
+  AACENC_POOL_STREAM *s = (AACENC_POOL_STREAM *)calloc(1, sizeof(*s));
+  AACENC_ERROR err;
+
+  *pStream = NULL;
+  if (s == NULL) return AACENC_MEMORY_ERROR;
+  s->key = *key;
+
+  if ((err = aacEncOpen(&s->hEncoder, 0,
+                        aacEncPool_Channels(key->channelMode))) != AACENC_OK) {
+    free(s);
+    return err;
+  }
+  if ((err = aacEncoder_SetParam(s->hEncoder, AACENC_AOT, key->aot)) ||
+      (err = aacEncoder_SetParam(s->hEncoder, AACENC_SAMPLERATE,
+                                 key->sampleRate)) ||
+      (err = aacEncoder_SetParam(s->hEncoder, AACENC_CHANNELMODE,
+                                 key->channelMode)) ||
+      (err = aacEncoder_SetParam(s->hEncoder, AACENC_BITRATEMODE,
+                                 key->bitrateMode)) ||
+      (key->bitrateMode == 0 &&
+       (err = aacEncoder_SetParam(s->hEncoder, AACENC_BITRATE,
+                                  key->bitrate))) ||
+      (err = aacEncoder_SetParam(s->hEncoder, AACENC_TRANSMUX,
+                                 key->transmux)) ||
+      (err = aacEncoder_SetParam(s->hEncoder, AACENC_AFTERBURNER,
+                                 key->afterburner)) ||
+      (err = aacEncEncode(s->hEncoder, NULL, NULL, NULL, NULL)) ||
+      (err = aacEncInfo(s->hEncoder, &s->info))) {
+    aacEncClose(&s->hEncoder);
+    free(s);
+    return err;
+  }
+  aacEncPool_GetKey(s->hEncoder, &s->applied);
+  *pStream = s;
+  return AACENC_OK;
+}
+
+/* Caller holds pool->lock. */
+static inline AACENC_POOL_BUCKET *aacEncPool_Bucket(AACENC_POOL *pool,
+                                                    const AACENC_POOL_KEY *key,
+                                                    int create) {
+  AACENC_POOL_BUCKET *b;
+
+  for (b = pool->buckets; b != NULL; b = b->next)
+    if (aacEncPool_KeyEqual(&b->key, key)) return b;
+  if (!create || (b = (AACENC_POOL_BUCKET *)calloc(1, sizeof(*b))) == NULL)
+    return NULL;
+  b->key = *key;
+  b->next = pool->buckets;
+  pool->buckets = b;
+  return b;
+}
+
+/**
+ * \brief  Get a ready-to-encode instance for key.
+ *
+ * A pooled instance is returned if there is one, otherwise a new one is
+ * opened and initialized outside the pool lock.
+ */
+static inline AACENC_ERROR aacEncPool_Acquire(HANDLE_AACENC_POOL pool,
+                                              const AACENC_POOL_KEY *key,
+                                              AACENC_POOL_STREAM **pStream) {
+  AACENC_POOL_BUCKET *b;
+  AACENC_POOL_STREAM *s = NULL;
+  AACENC_ERROR err;
+
+  pthread_mutex_lock(&pool->lock);
+  b = aacEncPool_Bucket(pool, key, 0);
+  if (b != NULL && (s = b->idle) != NULL) {
+    b->idle = s->next;
+    b->nIdle--;
+    pool->stats.idle--;
+    pool->stats.hits++;
+    pool->stats.active++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (s != NULL) {
+    s->next = NULL;
+    *pStream = s;
+    return AACENC_OK;
+  }
+
+  if ((err = aacEncPool_Create(key, pStream)) != AACENC_OK) return err;
+  pthread_mutex_lock(&pool->lock);
+  pool->stats.misses++;
+  pool->stats.active++;
+  pthread_mutex_unlock(&pool->lock);
+  return AACENC_OK;
+}
+
+/**
+ * \brief  Return an instance after its stream ended.
+ *
+ * The instance is reset in the calling thread and pooled, or closed when the
+ * reset fails or the key's free list is full. The caller must not use the
+ * stream afterwards.
+ *
+ * Acquired streams should not be reconfigured with aacEncoder_SetParam():
+ * the next stream with the same key would inherit the change. An instance
+ * whose keyed parameters no longer read back as they did after setup is
+ * closed instead of pooled; changes to other parameters are not detected.
+ */
+static inline void aacEncPool_Release(HANDLE_AACENC_POOL pool,
+                                      AACENC_POOL_STREAM *s) {
+  AACENC_POOL_KEY current;
+  AACENC_POOL_BUCKET *b;
+  int pooled = 0;
+
+  if (s == NULL) return;
+
+  aacEncPool_GetKey(s->hEncoder, &current);
+  if (aacEncPool_KeyEqual(&current, &s->applied) &&
+      aacEncoder_SetParam(s->hEncoder, AACENC_CONTROL_STATE,
+                          AACENC_INIT_STATES | AACENC_RESET_INBUFFER |
+                              AACENC_INIT_TRANSPORT) == AACENC_OK &&
+      aacEncEncode(s->hEncoder, NULL, NULL, NULL, NULL) == AACENC_OK) {
+    pthread_mutex_lock(&pool->lock);
+    b = aacEncPool_Bucket(pool, &s->key, 1);
+    if (b != NULL &&
+        (pool->maxIdlePerKey <= 0 || b->nIdle < pool->maxIdlePerKey)) {
+      s->next = b->idle;
+      b->idle = s;
+      b->nIdle++;
+      pool->stats.idle++;
+      pool->stats.resets++;
+      pooled = 1;
+    } else {
+      pool->stats.evicted++;
+    }
+    pool->stats.active--;
+    pthread_mutex_unlock(&pool->lock);
+  } else {
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.evicted++;
+    pool->stats.active--;
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  if (!pooled) {
+    aacEncClose(&s->hEncoder);
+    free(s);
+  }
+}
+
+/**
+ * \brief  Open count instances for key ahead of time, e.g. at service start.
+ */
+static inline AACENC_ERROR aacEncPool_Prewarm(HANDLE_AACENC_POOL pool,
+                                              const AACENC_POOL_KEY *key,
+                                              INT count) {
+  AACENC_POOL_STREAM *s;
+  AACENC_ERROR err;
+
+  for (; count > 0; count--) {
+    if ((err = aacEncPool_Create(key, &s)) != AACENC_OK) return err;
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.active++;
+    pthread_mutex_unlock(&pool->lock);
+    aacEncPool_Release(pool, s);
+  }
+  return AACENC_OK;
+}
+
+/**
+ * \brief  Encode the pending PCM of several streams on the calling thread.
+ *
+ * Each job is run to completion on its own instance: all of pcm is consumed
+ * (a trailing partial frame stays buffered in the encoder), and with flush
+ * set the encoder is drained until ::AACENC_ENCODE_EOF. Every access unit is
+ * passed to job->onAccessUnit.
+ *
+ * \return  AACENC_OK if all jobs succeeded, else the first job error; see
+ *          AACENC_POOL_JOB::err for the per-job result.
+ */
+static inline AACENC_ERROR aacEncPool_EncodeBatch(AACENC_POOL_JOB *jobs,
+                                                  INT nJobs) {
+  AACENC_ERROR ret = AACENC_OK;
+  INT i;
+
+  for (i = 0; i < nJobs; i++) {
+    AACENC_POOL_JOB *job = &jobs[i];
+    INT inId = IN_AUDIO_DATA, inElSize = sizeof(SHORT), inSize;
+    INT outId = OUT_BITSTREAM_DATA, outElSize = 1;
+    void *inPtr, *outPtr = job->outBuf;
+    AACENC_BufDesc inDesc, outDesc;
+    AACENC_InArgs inArgs;
+    AACENC_OutArgs outArgs;
+    AACENC_ERROR err = AACENC_OK;
+    int draining = 0;
+
+    job->samplesConsumed = 0;
+    job->accessUnits = 0;
+
+    outDesc.numBufs = 1;
+    outDesc.bufs = &outPtr;
+    outDesc.bufferIdentifiers = &outId;
+    outDesc.bufSizes = &job->outBufSize;
+    outDesc.bufElSizes = &outElSize;
+
+    inDesc.numBufs = 1;
+    inDesc.bufs = &inPtr;
+    inDesc.bufferIdentifiers = &inId;
+    inDesc.bufSizes = &inSize;
+    inDesc.bufElSizes = &inElSize;
+
+    for (;;) {
+      INT remaining = job->numSamples - job->samplesConsumed;
+
+      if (remaining == 0 && !job->flush) break;
+      draining = remaining == 0;
+
+      inPtr = (void *)(job->pcm + job->samplesConsumed);
+      inSize = remaining * (INT)sizeof(SHORT);
+      inDesc.numBufs = draining ? 0 : 1;
+      memset(&inArgs, 0, sizeof(inArgs));
+      memset(&outArgs, 0, sizeof(outArgs));
+      inArgs.numInSamples = draining ? -1 : remaining;
+
+      err = aacEncEncode(job->stream->hEncoder, &inDesc, &outDesc, &inArgs,
+                         &outArgs);
+      if (err == AACENC_ENCODE_EOF) {
+        err = AACENC_OK;
+        break;
+      }
+      if (err != AACENC_OK) break;
+
+      job->samplesConsumed += outArgs.numInSamples;
+      if (outArgs.numOutBytes > 0) {
+        job->accessUnits++;
+        if (job->onAccessUnit)
+          job->onAccessUnit(job->opaque, job->outBuf, outArgs.numOutBytes);
+      } else if (!draining && outArgs.numInSamples == 0) {
+        break; /* rest is buffered, waiting for a full frame */
+      } else if (draining) {
+        break; /* delay line drained */
+      }
+    }
+
+    job->err = err;
+    if (err != AACENC_OK && ret == AACENC_OK) ret = err;
+  }
+  return ret;
+}
+
+/**
+ * \brief  Read the pool statistics.
+ */
+static inline void aacEncPool_GetStats(HANDLE_AACENC_POOL pool,
+                                       AACENC_POOL_STATS *stats) {
+  pthread_mutex_lock(&pool->lock);
+  *stats = pool->stats;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * \brief  Close all pooled instances and free the pool. Instances still
+ *         acquired must be released before.
+ */
+static inline void aacEncPool_Close(HANDLE_AACENC_POOL *phPool) {
+  AACENC_POOL *pool = *phPool;
+  AACENC_POOL_BUCKET *b, *nb;
+  AACENC_POOL_STREAM *s, *ns;
+
+  if (pool == NULL) return;
+  for (b = pool->buckets; b != NULL; b = nb) {
+    nb = b->next;
+    for (s = b->idle; s != NULL; s = ns) {
+      ns = s->next;
+      aacEncClose(&s->hEncoder);
+      free(s);
+    }
+    free(b);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+  *phPool = NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AACENC_POOL_H */
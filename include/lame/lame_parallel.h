@@ -0,0 +1,498 @@
+/*
+ *	Parallel front-end to the MP3 LAME encoding engine
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef LAME_LAME_PARALLEL_H
+#define LAME_LAME_PARALLEL_H
+
+/*
+ * Encode one long PCM buffer on several lame_global_flags instances at
+ * once and stitch the result into a single gapless CBR stream.
+ *
+ * The output frame grid is split into segments of whole MP3 frames.  Each
+ * segment is encoded by its own encoder which starts `overlap_frames'
+ * frames early and runs `overlap_frames' frames past the segment end, so
+ * the psychoacoustic model and the MDCT have settled by the first kept
+ * frame.  Only the frames belonging to the segment are kept.
+ *
+ * Because the leading frames of every encoder are thrown away, a kept
+ * frame must never point back into them through main_data_begin, so the
+ * bit reservoir is disabled and CBR is forced.  Every frame is then self
+ * contained and frames from different encoders concatenate into a valid
+ * stream.  Encoder i's frame k lines up with global frame
+ * (first input sample / framesize + k), since all encoders share the same
+ * encoder delay.
+ *
+ * The first segment also writes the LAME/Info tag frame; once all segments
+ * are done it is patched with the stitched frame count, byte count, TOC,
+ * encoder delay/padding, music length and both CRCs, so players trim the
+ * stream exactly as if it had been produced serially.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lame.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* user callback: apply bitrate, quality, lowpass, ... to a fresh encoder */
+typedef void (*lame_parallel_config_function)(lame_global_flags *, void *opaque);
+
+typedef struct {
+  int nb_threads;       /* worker threads, <= 0: one per online CPU          */
+  int segment_frames;   /* MP3 frames per segment, <= 0: 1024 (~26s @44.1k) */
+  int overlap_frames;   /* warm-up/tail frames per side, <= 0: 4            */
+} lame_parallel_params;
+
+typedef struct {
+  int     segments;         /* number of independently encoded segments */
+  int     frames;           /* audio frames, not counting the tag frame */
+  size_t  bytes;            /* total stream size, tag frame included    */
+  int     encoder_delay;
+  int     encoder_padding;
+} lame_parallel_stats;
+
+/* max. Layer III frame size, padding slot included: MPEG-1 320 kbit/s at
+   32 kHz and MPEG-2.5 160 kbit/s at 8 kHz both give 1441 bytes */
+#define LAME_PARALLEL_MAX_FRAME 1441
+
+typedef struct {
+  lame_global_flags *gfp;   /* pre-opened encoder (first segment only) */
+  long           in_start;  /* input sample range fed to the encoder   */
+  long           in_end;
+  int            warmup;    /* leading frames to drop                  */
+  int            nb_frames; /* frames to keep, -1: all remaining        */
+  int            write_tag;
+  unsigned char *buf;
+  size_t         size;
+  size_t         cap;
+  size_t         keep_off;
+  size_t         keep_len;
+  int            kept;
+  unsigned char  tag[LAME_PARALLEL_MAX_FRAME];
+  size_t         tag_size;
+  int            ret;
+} lame_parallel_segment;
+
+typedef struct {
+  const short int              *pcm;
+  int                           num_channels;
+  int                           in_samplerate;
+  lame_parallel_config_function config;
+  void                         *opaque;
+  lame_parallel_segment        *seg;
+  int                           nb_seg;
+  int                           next;
+} lame_parallel_job;
+
+
+/* size of the Layer III frame starting at p, -1 if there is none */
+static inline int
+lame_parallel_frame_size(const unsigned char *p, size_t avail)
+{
+  static const int kbps[2][16] = {
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 },
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 }
+  };
+  static const int rate[4] = { 44100, 48000, 32000, 0 };
+  int version, lsf, br, sr;
+
+  if (avail < 4 || p[0] != 0xFF || (p[1] & 0xE0) != 0xE0)
+    return -1;
+  version = (p[1] >> 3) & 3;            /* 3: MPEG-1, 2: MPEG-2, 0: MPEG-2.5 */
+  if (version == 1 || ((p[1] >> 1) & 3) != 1)
+    return -1;
+  br = kbps[version == 3][p[2] >> 4];
+  sr = rate[(p[2] >> 2) & 3] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+  if (!br || !sr)
+    return -1;
+  lsf = version != 3;
+  return (lsf ? 72000 : 144000) * br / sr + ((p[2] >> 1) & 1);
+}
+
+/* CRC-16 as used by the LAME tag: polynomial 0x8005, reflected, init 0 */
+static inline unsigned int
+lame_parallel_crc16(unsigned int crc, const unsigned char *p, size_t len)
+{
+  unsigned short table[256];
+  unsigned int i, j, c;
+
+  for (i = 0; i < 256; i++) {
+    for (c = i, j = 0; j < 8; j++)
+      c = (c & 1) ? (c >> 1) ^ 0xA001 : c >> 1;
+    table[i] = (unsigned short) c;
+  }
+  while (len--)
+    crc = (crc >> 8) ^ table[(crc ^ *p++) & 0xFF];
+  return crc & 0xFFFF;
+}
+
+static inline lame_global_flags *
+lame_parallel_open(const lame_parallel_job *job, int write_tag)
+{
+  lame_global_flags *gfp = lame_init();
+
+  if (gfp == NULL)
+    return NULL;
+  lame_set_in_samplerate(gfp, job->in_samplerate);
+  lame_set_num_channels(gfp, job->num_channels);
+  if (job->config)
+    job->config(gfp, job->opaque);
+  /* segments must be self contained and concatenable, see above */
+  lame_set_VBR(gfp, vbr_off);
+  lame_set_disable_reservoir(gfp, 1);
+  lame_set_bWriteVbrTag(gfp, write_tag);
+  lame_set_write_id3tag_automatic(gfp, 0);
+  /* per-segment gain analysis would describe only part of the stream */
+  lame_set_findReplayGain(gfp, 0);
+  lame_set_decode_on_the_fly(gfp, 0);
+  if (lame_init_params(gfp) < 0) {
+    lame_close(gfp);
+    return NULL;
+  }
+  return gfp;
+}
+
+static inline int
+lame_parallel_reserve(lame_parallel_segment *s, size_t need)
+{
+  unsigned char *buf;
+  size_t cap = s->cap;
+
+  if (s->cap - s->size >= need)
+    return 0;
+  while (cap - s->size < need)
+    cap = cap ? cap * 2 : 65536;
+  buf = (unsigned char *) realloc(s->buf, cap);
+  if (buf == NULL)
+    return -2;
+  s->buf = buf;
+  s->cap = cap;
+  return 0;
+}
+
+static inline int
+lame_parallel_encode_segment(const lame_parallel_job *job, lame_parallel_segment *s)
+{
+  const int chunk = 16 * 1152;
+  lame_global_flags *gfp = s->gfp;
+  size_t off;
+  long pos;
+  int ret, n, idx, fs;
+
+  if (gfp == NULL && (gfp = lame_parallel_open(job, s->write_tag)) == NULL)
+    return -1;
+  s->gfp = NULL;
+
+  for (pos = s->in_start, ret = 0; pos < s->in_end && ret >= 0; pos += n) {
+    n = s->in_end - pos < chunk ? (int) (s->in_end - pos) : chunk;
+    if ((ret = lame_parallel_reserve(s, (size_t) (1.25 * n) + 7200)) < 0)
+      break;
+    if (job->num_channels == 2)
+      ret = lame_encode_buffer_interleaved(gfp, (short int *) job->pcm + 2 * pos, n,
+                                           s->buf + s->size, (int) (s->cap - s->size));
+    else
+      ret = lame_encode_buffer(gfp, job->pcm + pos, job->pcm + pos, n,
+                               s->buf + s->size, (int) (s->cap - s->size));
+    if (ret > 0)
+      s->size += ret;
+  }
+  if (ret >= 0 && (ret = lame_parallel_reserve(s, 7200)) >= 0) {
+    ret = lame_encode_flush(gfp, s->buf + s->size, (int) (s->cap - s->size));
+    if (ret > 0)
+      s->size += ret;
+  }
+  if (ret >= 0 && s->write_tag) {
+    s->tag_size = lame_get_lametag_frame(gfp, s->tag, sizeof(s->tag));
+    if (s->tag_size == 0 || s->tag_size > sizeof(s->tag))
+      ret = -1;
+  }
+  lame_close(gfp);
+  if (ret < 0)
+    return ret;
+
+  /* walk the frames, dropping the tag placeholder, warm-up and tail */
+  off = 0;
+  if (s->write_tag) {
+    if (lame_parallel_frame_size(s->buf, s->size) != (int) s->tag_size)
+      return -1;
+    off = s->tag_size;
+  }
+  for (idx = 0; off < s->size; idx++, off += fs) {
+    fs = lame_parallel_frame_size(s->buf + off, s->size - off);
+    if (fs < 0 || off + fs > s->size)
+      return -1;
+    if (idx == s->warmup)
+      s->keep_off = off;
+    if (idx >= s->warmup && (s->nb_frames < 0 || idx < s->warmup + s->nb_frames)) {
+      s->keep_len = off + fs - s->keep_off;
+      s->kept++;
+    }
+  }
+  if (s->nb_frames >= 0 && s->kept != s->nb_frames)
+    return -1;
+  return 0;
+}
+
+static inline void *
+lame_parallel_worker(void *arg)
+{
+  lame_parallel_job *job = (lame_parallel_job *) arg;
+  int i;
+
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nb_seg)
+    job->seg[i].ret = lame_parallel_encode_segment(job, &job->seg[i]);
+  return NULL;
+}
+
+static inline void
+lame_parallel_wb32(unsigned char *p, unsigned long v)
+{
+  p[0] = (unsigned char) (v >> 24);
+  p[1] = (unsigned char) (v >> 16);
+  p[2] = (unsigned char) (v >> 8);
+  p[3] = (unsigned char) v;
+}
+
+/* rewrite the Info/LAME tag at the start of the stitched stream */
+static inline int
+lame_parallel_patch_tag(unsigned char *out, size_t total, size_t tag_size,
+                        int frames, int delay, int padding)
+{
+  int mono = (out[3] >> 6) == 3;
+  int lsf = ((out[1] >> 3) & 3) != 3;
+  size_t p = 4 + (out[1] & 1 ? 0 : 2) + (lsf ? (mono ? 9 : 17) : (mono ? 17 : 32));
+  unsigned long flags;
+  unsigned int crc;
+
+  if (p + 8 > tag_size || (memcmp(out + p, "Info", 4) && memcmp(out + p, "Xing", 4)))
+    return -1;
+  flags = (unsigned long) out[p + 4] << 24 | out[p + 5] << 16 | out[p + 6] << 8 | out[p + 7];
+  p += 8;
+  if (flags & 1) {
+    lame_parallel_wb32(out + p, (unsigned long) frames);
+    p += 4;
+  }
+  if (flags & 2) {
+    lame_parallel_wb32(out + p, (unsigned long) total);
+    p += 4;
+  }
+  if (flags & 4) {
+    size_t off = tag_size;
+    int i, frame = 0, fs;
+
+    for (i = 0; i < 100; i++) {
+      int target = (int) ((long long) i * frames / 100);
+
+      while (frame < target && (fs = lame_parallel_frame_size(out + off, total - off)) > 0) {
+        off += fs;
+        frame++;
+      }
+      out[p + i] = (unsigned char) (off * 256 / total > 255 ? 255 : off * 256 / total);
+    }
+    p += 100;
+  }
+  if (flags & 8)
+    p += 4;
+
+  if (p + 36 > tag_size || memcmp(out + p, "LAME", 4))
+    return 0;                           /* plain Xing tag, nothing more to fix */
+  if (delay > 4095)
+    delay = 4095;
+  if (padding > 4095)
+    padding = 4095;
+  out[p + 21] = (unsigned char) (delay >> 4);
+  out[p + 22] = (unsigned char) ((delay & 15) << 4 | padding >> 8);
+  out[p + 23] = (unsigned char) padding;
+  lame_parallel_wb32(out + p + 28, (unsigned long) total);
+  crc = lame_parallel_crc16(0, out + tag_size, total - tag_size);
+  out[p + 32] = (unsigned char) (crc >> 8);
+  out[p + 33] = (unsigned char) crc;
+  crc = lame_parallel_crc16(0, out, p + 34);
+  out[p + 34] = (unsigned char) (crc >> 8);
+  out[p + 35] = (unsigned char) crc;
+  return 0;
+}
+
+/*
+ * Encode num_samples samples per channel of 16 bit PCM (interleaved when
+ * num_channels is 2) into a complete MP3 stream, Info/LAME tag included.
+ *
+ * config, if not NULL, is called on every encoder before lame_init_params()
+ * and must apply identical settings each time.  VBR, the bit reservoir,
+ * ID3 tags and ReplayGain analysis are overridden as described above.
+ *
+ * The segments are cut on the output frame grid, which only matches the
+ * input when LAME does not resample.  LAME resamples when config sets a
+ * different lame_set_out_samplerate(), and on its own for low CBR bitrates
+ * (44.1 kHz input at 64 kbit/s or less, for example).  Such setups are
+ * rejected; resample the PCM beforehand, or pin the output rate with
+ * lame_set_out_samplerate(gfp, in_samplerate) in config.
+ *
+ * On success *mp3 holds *mp3_size bytes allocated with malloc().
+ *
+ * return code:  0 on success
+ *              -1 invalid arguments or encoder error
+ *              -2 out of memory
+ *              -3 LAME would resample (output rate != in_samplerate)
+ */
+static inline int
+lame_parallel_encode(const short int *pcm, unsigned long num_samples,
+                     int num_channels, int in_samplerate,
+                     lame_parallel_config_function config, void *opaque,
+                     const lame_parallel_params *params,
+                     unsigned char **mp3, size_t *mp3_size,
+                     lame_parallel_stats *stats)
+{
+  lame_parallel_job job;
+  lame_global_flags *gfp;
+  pthread_t *threads;
+  unsigned char *out;
+  size_t total;
+  int i, ret = 0, nb_threads, seg_frames, overlap, framesize, delay;
+  int est_frames, frames, padding, started = 0;
+
+  *mp3 = NULL;
+  *mp3_size = 0;
+  if (pcm == NULL || num_samples == 0 || num_samples > 0x7FFFFFFFUL ||
+      (num_channels != 1 && num_channels != 2))
+    return -1;
+
+  nb_threads = params && params->nb_threads > 0 ? params->nb_threads
+                                                : (int) sysconf(_SC_NPROCESSORS_ONLN);
+  seg_frames = params && params->segment_frames > 0 ? params->segment_frames : 1024;
+  overlap    = params && params->overlap_frames > 0 ? params->overlap_frames : 4;
+  if (nb_threads < 1)
+    nb_threads = 1;
+
+  memset(&job, 0, sizeof(job));
+  job.pcm           = pcm;
+  job.num_channels  = num_channels;
+  job.in_samplerate = in_samplerate;
+  job.config        = config;
+  job.opaque        = opaque;
+
+  /* the first segment's encoder doubles as probe for the frame grid */
+  if ((gfp = lame_parallel_open(&job, 1)) == NULL)
+    return -1;
+  if (lame_get_out_samplerate(gfp) != in_samplerate) {
+    lame_close(gfp);
+    return -3;
+  }
+  framesize = lame_get_framesize(gfp);
+  delay     = lame_get_encoder_delay(gfp);
+  if (delay >= overlap * framesize)
+    overlap = delay / framesize + 1;
+
+  est_frames = (int) ((num_samples + delay + framesize - 1) / framesize);
+  job.nb_seg = (est_frames + seg_frames - 1) / seg_frames;
+  job.seg = (lame_parallel_segment *) calloc(job.nb_seg, sizeof(*job.seg));
+  threads = (pthread_t *) calloc(nb_threads, sizeof(*threads));
+  if (job.seg == NULL || threads == NULL) {
+    lame_close(gfp);
+    free(job.seg);
+    free(threads);
+    return -2;
+  }
+
+  for (i = 0; i < job.nb_seg; i++) {
+    lame_parallel_segment *s = &job.seg[i];
+    int first = i * seg_frames;
+    int start = first > overlap ? first - overlap : 0;
+
+    s->warmup    = first - start;
+    s->nb_frames = i == job.nb_seg - 1 ? -1 : seg_frames;
+    s->in_start  = (long) start * framesize;
+    s->in_end    = i == job.nb_seg - 1 ? (long) num_samples
+                                       : (long) (first + seg_frames + overlap) * framesize;
+    if (s->in_start > (long) num_samples)
+      s->in_start = (long) num_samples;
+    if (s->in_end > (long) num_samples)
+      s->in_end = (long) num_samples;
+    s->write_tag = i == 0;
+  }
+  job.seg[0].gfp = gfp;
+
+  if (nb_threads > job.nb_seg)
+    nb_threads = job.nb_seg;
+  for (i = 1; i < nb_threads; i++, started++)
+    if (pthread_create(&threads[i], NULL, lame_parallel_worker, &job))
+      break;
+  lame_parallel_worker(&job);
+  for (i = 1; i <= started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  /* stitch: tag frame, then the kept frames of every segment */
+  total  = job.seg[0].tag_size;
+  frames = 0;
+  for (i = 0; i < job.nb_seg; i++) {
+    if (job.seg[i].gfp)
+      lame_close(job.seg[i].gfp);
+    if (job.seg[i].ret < 0 && ret == 0)
+      ret = job.seg[i].ret;
+    total  += job.seg[i].keep_len;
+    frames += job.seg[i].kept;
+  }
+  padding = frames * framesize - delay - (int) num_samples;
+  if (ret == 0 && padding < 0)
+    ret = -1;
+  out = ret == 0 ? (unsigned char *) malloc(total) : NULL;
+  if (ret == 0 && out == NULL)
+    ret = -2;
+  if (ret == 0) {
+    size_t off = job.seg[0].tag_size;
+
+    memcpy(out, job.seg[0].tag, off);
+    for (i = 0; i < job.nb_seg; i++) {
+      memcpy(out + off, job.seg[i].buf + job.seg[i].keep_off, job.seg[i].keep_len);
+      off += job.seg[i].keep_len;
+    }
+    if (lame_parallel_patch_tag(out, total, job.seg[0].tag_size, frames, delay, padding) < 0) {
+      free(out);
+      ret = -1;
+    }
+  }
+  for (i = 0; i < job.nb_seg; i++)
+    free(job.seg[i].buf);
+  free(job.seg);
+  if (ret < 0)
+    return ret;
+
+  *mp3 = out;
+  *mp3_size = total;
+  if (stats) {
+    stats->segments        = job.nb_seg;
+    stats->frames          = frames;
+    stats->bytes           = total;
+    stats->encoder_delay   = delay;
+    stats->encoder_padding = padding;
+  }
+  return 0;
+}
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* LAME_LAME_PARALLEL_H */
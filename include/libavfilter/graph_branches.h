@@ -0,0 +1,439 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVFILTER_GRAPH_BRANCHES_H
+#define AVFILTER_GRAPH_BRANCHES_H
+
+/**
+ * @file
+ * @ingroup lavfi
+ * Run the branches of a split filtergraph on separate threads.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "libavutil/error.h"
+#include "libavutil/frame.h"
+#include "libavutil/mem.h"
+#include "libavutil/threadmessage_spsc.h"
+
+#include "avfilter.h"
+#include "buffersink.h"
+#include "buffersrc.h"
+
+/**
+ * @addtogroup lavfi
+ * @{
+ *
+ * A graph such as
+ * @code
+ * [in] yadif, split=3 [a][b][c];
+ * [a] scale=1920:1080 [o0]; [b] scale=1280:720 [o1]; [c] scale=640:360 [o2]
+ * @endcode
+ * runs in one thread inside libavfilter, even though the three outputs share
+ * nothing after the split. AVFilterBranchRunner instead builds the part
+ * before the split (the trunk, "yadif") and each branch ("scale=1920:1080",
+ * ...) as separate graphs. The trunk runs in the calling thread; each branch
+ * runs in its own thread behind a bounded queue.
+ *
+ * Trunk output frames are passed to every branch by reference, exactly as
+ * the split filter does, so the branches share the data and filters that
+ * write to it make their own copy. Each branch sees its frames in trunk
+ * order with their timestamps untouched. When a queue is full the caller
+ * blocks, which bounds memory to queue_size frames per branch.
+ *
+ * AVFilterGraph.nb_threads still applies inside each graph, so slice
+ * threading can be combined with branch threading.
+ */
+
+/**
+ * Called on the branch thread for every frame a branch outputs. The frame
+ * is unreferenced after the call returns; move it to keep it.
+ *
+ * @return 0 to continue, a negative AVERROR to stop the branch
+ */
+typedef int (*AVFilterBranchOutput)(void *opaque, int branch, AVFrame *frame);
+
+typedef struct AVFilterBranchRunner AVFilterBranchRunner;
+
+typedef struct AVFilterBranch {
+    AVFilterBranchRunner     *runner;
+    int                       index;
+    AVFilterGraph            *graph;
+    AVFilterContext          *src;
+    AVFilterContext          *sink;
+    AVThreadMessageQueueSPSC *queue;
+    pthread_t                 thread;
+    int                       thread_started;
+    int                       done;     ///< branch reached EOF, takes no more frames
+    int                       err;
+} AVFilterBranch;
+
+struct AVFilterBranchRunner {
+    AVFilterGraph        *trunk;
+    AVFilterContext      *src;
+    AVFilterContext      *sink;
+    AVFrame              *frame;
+    AVFilterBranch       *branches;
+    int                   nb_branches;
+    int                   eof;
+    AVFilterBranchOutput  output;
+    void                 *opaque;
+};
+
+/**
+ * Build "[buffer] desc [buffersink]" in a new graph.
+ */
+static inline int avfilter_branch_graph_build(AVFilterGraph **pgraph, AVFilterContext **psrc,
+                                              AVFilterContext **psink, enum AVMediaType type,
+                                              AVBufferSrcParameters *par, int channels,
+                                              const char *desc, int nb_threads)
+{
+    int audio = type == AVMEDIA_TYPE_AUDIO;
+    AVFilterInOut *inputs = NULL, *outputs = NULL;
+    AVFilterContext *src, *sink;
+    AVFilterGraph *graph;
+    char args[32];
+    int ret;
+
+    *pgraph = graph = avfilter_graph_alloc();
+    if (!graph)
+        return AVERROR(ENOMEM);
+    graph->nb_threads = nb_threads;
+
+    src = avfilter_graph_alloc_filter(graph, avfilter_get_by_name(audio ? "abuffer" : "buffer"), "in");
+    if (!src)
+        return AVERROR(ENOMEM);
+    if ((ret = av_buffersrc_parameters_set(src, par)) < 0)
+        return ret;
+    if (audio && !par->channel_layout && channels > 0)
+        snprintf(args, sizeof(args), "channels=%d", channels);
+    else
+        args[0] = 0;
+    if ((ret = avfilter_init_str(src, args[0] ? args : NULL)) < 0)
+        return ret;
+
+    ret = avfilter_graph_create_filter(&sink, avfilter_get_by_name(audio ? "abuffersink" : "buffersink"),
+                                       "out", NULL, NULL, graph);
+    if (ret < 0)
+        return ret;
+
+    outputs = avfilter_inout_alloc();
+    inputs  = avfilter_inout_alloc();
+    if (!outputs || !inputs) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    outputs->name       = av_strdup("in");
+    outputs->filter_ctx = src;
+    inputs->name        = av_strdup("out");
+    inputs->filter_ctx  = sink;
+    if (!outputs->name || !inputs->name) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if (!desc || !*desc)
+        desc = audio ? "anull" : "null";
+    if ((ret = avfilter_graph_parse_ptr(graph, desc, &inputs, &outputs, NULL)) < 0)
+        goto end;
+    if ((ret = avfilter_graph_config(graph, NULL)) < 0)
+        goto end;
+
+    *psrc  = src;
+    *psink = sink;
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    return ret;
+}
+
+/**
+ * Pass every frame available on a sink to the output callback.
+ *
+ * @return 0 when the sink needs more input, AVERROR_EOF at the end of the
+ *         stream, another negative AVERROR on failure
+ */
+static inline int avfilter_branch_drain(AVFilterBranch *b, AVFrame *frame)
+{
+    AVFilterBranchRunner *r = b->runner;
+    int ret;
+
+    while ((ret = av_buffersink_get_frame(b->sink, frame)) >= 0) {
+        ret = r->output(r->opaque, b->index, frame);
+        av_frame_unref(frame);
+        if (ret < 0)
+            return ret;
+    }
+    return ret == AVERROR(EAGAIN) ? 0 : ret;
+}
+
+static inline void *avfilter_branch_thread(void *arg)
+{
+    AVFilterBranch *b = (AVFilterBranch *)arg;
+    AVFrame *out = av_frame_alloc();
+    AVFrame *in;
+    int ret = out ? 0 : AVERROR(ENOMEM);
+
+    while (ret >= 0) {
+        ret = av_thread_message_queue_spsc_recv(b->queue, &in, 0);
+        if (ret < 0)
+            break;
+        /* a NULL frame marks the end of the stream */
+        ret = av_buffersrc_add_frame_flags(b->src, in, 0);
+        av_frame_free(&in);
+        if (ret >= 0)
+            ret = avfilter_branch_drain(b, out);
+    }
+    av_frame_free(&out);
+
+    if (ret != AVERROR_EOF)
+        b->err = ret;
+    /* unblock the caller if it is waiting for space */
+    av_thread_message_queue_spsc_set_err_send(b->queue, ret);
+    return NULL;
+}
+
+static inline void avfilter_branch_free_msg(void *msg)
+{
+    av_frame_free((AVFrame **)msg);
+}
+
+/**
+ * Stop all branches and free the runner. Frames still queued are dropped.
+ */
+static inline void avfilter_branch_runner_free(AVFilterBranchRunner **pr)
+{
+    AVFilterBranchRunner *r = *pr;
+    int i;
+
+    if (!r)
+        return;
+    for (i = 0; i < r->nb_branches; i++) {
+        AVFilterBranch *b = &r->branches[i];
+        if (b->thread_started) {
+            av_thread_message_queue_spsc_set_err_recv(b->queue, AVERROR_EXIT);
+            pthread_join(b->thread, NULL);
+        }
+        if (b->queue) {
+            av_thread_message_queue_spsc_flush(b->queue);
+            av_thread_message_queue_spsc_free(&b->queue);
+        }
+        avfilter_graph_free(&b->graph);
+    }
+    av_freep(&r->branches);
+    av_frame_free(&r->frame);
+    avfilter_graph_free(&r->trunk);
+    av_freep(pr);
+}
+
+/**
+ * Build the trunk and branch graphs and start one thread per branch.
+ *
+ * @param pr          set to the new runner, NULL on failure
+ * @param type        AVMEDIA_TYPE_VIDEO or AVMEDIA_TYPE_AUDIO
+ * @param par         parameters of the input frames; audio needs a
+ *                    channel_layout
+ * @param trunk       filters before the split, NULL or "" for none
+ * @param branches    filters of each branch after the split
+ * @param nb_branches number of branches
+ * @param queue_size  frames queued per branch, 0 for the default (8)
+ * @param nb_threads  AVFilterGraph.nb_threads for every graph
+ * @param output      called for every frame a branch outputs
+ * @param opaque      passed to output
+ * @return 0 on success, a negative AVERROR on failure
+ */
+static inline int avfilter_branch_runner_alloc(AVFilterBranchRunner **pr, enum AVMediaType type,
+                                               AVBufferSrcParameters *par, const char *trunk,
+                                               const char * const *branches, int nb_branches,
+                                               int queue_size, int nb_threads,
+                                               AVFilterBranchOutput output, void *opaque)
+{
+    AVBufferSrcParameters *bpar = NULL;
+    AVFilterBranchRunner *r;
+    int i, ret;
+
+    *pr = NULL;
+    if (nb_branches < 1 || !output)
+        return AVERROR(EINVAL);
+    r = (AVFilterBranchRunner *)av_mallocz(sizeof(*r));
+    if (!r)
+        return AVERROR(ENOMEM);
+    r->output   = output;
+    r->opaque   = opaque;
+    r->frame    = av_frame_alloc();
+    r->branches = (AVFilterBranch *)av_calloc(nb_branches, sizeof(*r->branches));
+    if (!r->frame || !r->branches) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    r->nb_branches = nb_branches;
+
+    ret = avfilter_branch_graph_build(&r->trunk, &r->src, &r->sink, type, par, 0, trunk, nb_threads);
+    if (ret < 0)
+        goto fail;
+
+    /* every branch takes what the trunk outputs */
+    bpar = av_buffersrc_parameters_alloc();
+    if (!bpar) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    bpar->format              = av_buffersink_get_format(r->sink);
+    bpar->time_base           = av_buffersink_get_time_base(r->sink);
+    bpar->width               = av_buffersink_get_w(r->sink);
+    bpar->height              = av_buffersink_get_h(r->sink);
+    bpar->sample_aspect_ratio = av_buffersink_get_sample_aspect_ratio(r->sink);
+    bpar->frame_rate          = av_buffersink_get_frame_rate(r->sink);
+    bpar->hw_frames_ctx       = av_buffersink_get_hw_frames_ctx(r->sink);
+    bpar->sample_rate         = av_buffersink_get_sample_rate(r->sink);
+    bpar->channel_layout      = av_buffersink_get_channel_layout(r->sink);
+
+    for (i = 0; i < nb_branches; i++) {
+        AVFilterBranch *b = &r->branches[i];
+
+        b->runner = r;
+        b->index  = i;
+        ret = avfilter_branch_graph_build(&b->graph, &b->src, &b->sink, type, bpar,
+                                          av_buffersink_get_channels(r->sink),
+                                          branches[i], nb_threads);
+        if (ret < 0)
+            goto fail;
+        ret = av_thread_message_queue_spsc_alloc(&b->queue, queue_size > 0 ? queue_size : 8,
+                                                 sizeof(AVFrame *), 0);
+        if (ret < 0)
+            goto fail;
+        av_thread_message_queue_spsc_set_free_func(b->queue, avfilter_branch_free_msg);
+        if ((ret = pthread_create(&b->thread, NULL, avfilter_branch_thread, b))) {
+            ret = AVERROR(ret);
+            goto fail;
+        }
+        b->thread_started = 1;
+    }
+    av_free(bpar);
+    *pr = r;
+    return 0;
+
+fail:
+    av_free(bpar);
+    avfilter_branch_runner_free(&r);
+    return ret;
+}
+
+/**
+ * Feed one frame through the trunk and queue its output on every branch.
+ * Blocks while a branch queue is full.
+ *
+ * @param frame the input frame, unreferenced on return; NULL to signal the
+ *              end of the stream
+ * A branch that has reached the end of its stream, e.g. through trim, is
+ * skipped from then on; only other branch errors fail the call.
+ *
+ * @return 0 on success, the error of the first failing branch or trunk
+ */
+static inline int avfilter_branch_runner_send_frame(AVFilterBranchRunner *r, AVFrame *frame)
+{
+    int i, ret, eof = 0;
+
+    if (r->eof)
+        return AVERROR_EOF;
+    ret = av_buffersrc_add_frame_flags(r->src, frame, 0);
+    if (ret < 0)
+        return ret;
+
+    while ((ret = av_buffersink_get_frame(r->sink, r->frame)) >= 0) {
+        for (i = 0; i < r->nb_branches; i++) {
+            AVFilterBranch *b = &r->branches[i];
+            AVFrame *ref;
+
+            if (b->done)
+                continue;
+            ref = av_frame_clone(r->frame);
+            if (!ref) {
+                av_frame_unref(r->frame);
+                return AVERROR(ENOMEM);
+            }
+            ret = av_thread_message_queue_spsc_send(b->queue, &ref, 0);
+            if (ret < 0) {
+                av_frame_free(&ref);
+                /* a branch may end early, e.g. with trim; the others go on */
+                if (ret == AVERROR_EOF) {
+                    b->done = 1;
+                    continue;
+                }
+                av_frame_unref(r->frame);
+                return ret;
+            }
+        }
+        av_frame_unref(r->frame);
+    }
+    if (ret == AVERROR_EOF)
+        eof = 1;
+    else if (ret != AVERROR(EAGAIN))
+        return ret;
+
+    if (eof) {
+        r->eof = 1;
+        for (i = 0; i < r->nb_branches; i++) {
+            AVFilterBranch *b = &r->branches[i];
+            AVFrame *end = NULL;
+
+            if (b->done)
+                continue;
+            ret = av_thread_message_queue_spsc_send(b->queue, &end, 0);
+            if (ret == AVERROR_EOF)
+                b->done = 1;
+            else if (ret < 0)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Signal the end of the stream if not done yet, wait for every branch to
+ * output its last frame and stop the threads.
+ *
+ * @return 0 on success, the first branch error otherwise
+ */
+static inline int avfilter_branch_runner_finish(AVFilterBranchRunner *r)
+{
+    int i, ret = 0, err;
+
+    if (!r->eof && (err = avfilter_branch_runner_send_frame(r, NULL)) < 0)
+        ret = err;
+    for (i = 0; i < r->nb_branches; i++) {
+        AVFilterBranch *b = &r->branches[i];
+        if (b->thread_started) {
+            if (ret < 0)
+                av_thread_message_queue_spsc_set_err_recv(b->queue, AVERROR_EXIT);
+            pthread_join(b->thread, NULL);
+            b->thread_started = 0;
+        }
+        if (!ret && b->err < 0)
+            ret = b->err;
+    }
+    return ret;
+}
+
+/**
+ * @}
+ */
+
+#endif /* AVFILTER_GRAPH_BRANCHES_H */
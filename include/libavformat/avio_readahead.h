@@ -0,0 +1,532 @@
+/*
+ * Shared read-ahead I/O engine for custom AVIOContexts
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVFORMAT_AVIO_READAHEAD_H
+#define AVFORMAT_AVIO_READAHEAD_H
+
+/**
+ * @file
+ * @ingroup lavf_io
+ * Read-ahead backend for avio_alloc_context().
+ *
+ * An AVIOReadAheadEngine owns a small pool of I/O threads shared by any
+ * number of AVIOContexts opened with avio_readahead_open(). Each context
+ * keeps a window of fixed size blocks in flight ahead of the read
+ * position. Its read_packet callback only copies out of a completed
+ * block, so a demuxer blocks only when it outruns the disk. One or two
+ * I/O threads can keep hundreds of demuxers fed, where the default file
+ * protocol spends one blocking read() per demuxer thread.
+ *
+ * Block buffers are page aligned and allocated once per context.
+ * AVIO_FLAG_DIRECT bypasses the OS page cache: O_DIRECT where it exists,
+ * F_NOCACHE on Darwin. Block offsets and sizes stay multiples of the page
+ * size to meet O_DIRECT alignment rules.
+ *
+ * Usage with libavformat:
+ * @code
+ * AVIOReadAheadEngine *engine = avio_readahead_engine_alloc(2);
+ * AVFormatContext *fmt = avformat_alloc_context();
+ * avio_readahead_open(&fmt->pb, engine, path, AVIO_FLAG_READ, 0, 0);
+ * fmt->flags |= AVFMT_FLAG_CUSTOM_IO;
+ * avformat_open_input(&fmt, NULL, NULL, NULL);
+ * ...
+ * AVIOContext *pb = fmt->pb;    // fmt is freed by avformat_close_input()
+ * avformat_close_input(&fmt);   // does not touch a custom pb
+ * avio_readahead_close(&pb);
+ * @endcode
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+#include "libavutil/mem.h"
+#include "avio.h"
+
+#define AVIO_READAHEAD_DEFAULT_BLOCK  (256 * 1024)
+#define AVIO_READAHEAD_DEFAULT_WINDOW 4
+#define AVIO_READAHEAD_ALIGN          4096
+
+enum AVIOReadAheadBlockState {
+    AVIO_READAHEAD_IDLE,
+    AVIO_READAHEAD_QUEUED,
+    AVIO_READAHEAD_READING,
+    AVIO_READAHEAD_READY,
+};
+
+typedef struct AVIOReadAheadStats {
+    uint64_t bytes_read;     ///< bytes read from disk by the I/O threads
+    uint64_t blocks_read;    ///< completed block reads
+    uint64_t stalls;         ///< read_packet calls that had to wait for a block
+    uint64_t seeks;          ///< seeks outside the read-ahead window
+} AVIOReadAheadStats;
+
+struct AVIOReadAheadStream;
+
+typedef struct AVIOReadAheadBlock {
+    struct AVIOReadAheadStream *stream;
+    struct AVIOReadAheadBlock *next;   ///< engine queue link
+    uint8_t *data;
+    int64_t pos;                       ///< file offset the block is meant to hold
+    int size;                          ///< valid bytes once ready
+    int err;                           ///< AVERROR code of a failed read
+    int state;
+    int stale;                         ///< retargeted while being read
+} AVIOReadAheadBlock;
+
+typedef struct AVIOReadAheadEngine {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_t *threads;
+    int nb_threads;
+    int quit;
+    AVIOReadAheadBlock *head, *tail;
+    AVIOReadAheadStats stats;
+} AVIOReadAheadEngine;
+
+typedef struct AVIOReadAheadStream {
+    AVIOReadAheadEngine *engine;
+    pthread_cond_t ready;
+    int fd;
+    int direct;             ///< opened with O_DIRECT
+    int64_t file_size;
+    int block_size;
+    int window;
+    AVIOReadAheadBlock *blocks;
+    int first;              ///< ring index of the block holding window_pos
+    int64_t window_pos;     ///< file offset of blocks[first]
+    int64_t pos;            ///< logical read position
+    int reading;            ///< blocks currently being read by the engine
+    int closing;            ///< being freed, blocks must not be requeued
+} AVIOReadAheadStream;
+
+/* Engine lock held. */
+static inline void avio_readahead_enqueue(AVIOReadAheadBlock *b, int64_t pos)
+{
+    AVIOReadAheadEngine *e = b->stream->engine;
+
+    b->pos = pos;
+    b->size = 0;
+    b->err = 0;
+    if (b->state == AVIO_READAHEAD_READING) {
+        b->stale = 1;
+        return;
+    }
+    if (b->state == AVIO_READAHEAD_QUEUED)
+        return;
+    if (pos >= b->stream->file_size) {
+        b->state = AVIO_READAHEAD_READY;
+        return;
+    }
+    b->state = AVIO_READAHEAD_QUEUED;
+    b->next = NULL;
+    if (e->tail)
+        e->tail->next = b;
+    else
+        e->head = b;
+    e->tail = b;
+    pthread_cond_signal(&e->work);
+}
+
+static inline void *avio_readahead_worker(void *arg)
+{
+    AVIOReadAheadEngine *e = (AVIOReadAheadEngine *)arg;
+
+    pthread_mutex_lock(&e->lock);
+    for (;;) {
+        AVIOReadAheadBlock *b;
+        AVIOReadAheadStream *s;
+        int64_t pos;
+        int size = 0, err = 0;
+
+        while (!e->head && !e->quit)
+            pthread_cond_wait(&e->work, &e->lock);
+        if (!e->head)
+            break;
+
+        b = e->head;
+        e->head = b->next;
+        if (!e->head)
+            e->tail = NULL;
+        s = b->stream;
+        b->state = AVIO_READAHEAD_READING;
+        b->stale = 0;
+        pos = b->pos;
+        s->reading++;
+        pthread_mutex_unlock(&e->lock);
+
+        while (size < s->block_size) {
+            ssize_t n = pread(s->fd, b->data + size, s->block_size - size, pos + size);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                err = AVERROR(errno);
+                break;
+            }
+            if (n == 0)
+                break;
+            size += n;
+            /* A short read under O_DIRECT is end of data: a retry at
+             * pos + size would be unaligned and fail with EINVAL. */
+            if (s->direct)
+                break;
+        }
+
+        pthread_mutex_lock(&e->lock);
+        s->reading--;
+        b->state = AVIO_READAHEAD_IDLE;
+        if (b->stale) {
+            if (!s->closing)
+                avio_readahead_enqueue(b, b->pos);
+        } else {
+            b->state = AVIO_READAHEAD_READY;
+            b->size = size;
+            b->err = err;
+            e->stats.bytes_read += size;
+            e->stats.blocks_read++;
+        }
+        pthread_cond_broadcast(&s->ready);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+/* Engine lock held. Moves the oldest block of the window to its far end. */
+static inline void avio_readahead_advance(AVIOReadAheadStream *s)
+{
+    avio_readahead_enqueue(&s->blocks[s->first],
+                           s->window_pos + (int64_t)s->window * s->block_size);
+    s->first = (s->first + 1) % s->window;
+    s->window_pos += s->block_size;
+}
+
+/* Engine lock held. Points the whole window at the block containing pos. */
+static inline void avio_readahead_reset(AVIOReadAheadStream *s, int64_t pos)
+{
+    int i;
+
+    s->first = 0;
+    s->window_pos = pos - pos % s->block_size;
+    for (i = 0; i < s->window; i++)
+        avio_readahead_enqueue(&s->blocks[i], s->window_pos + (int64_t)i * s->block_size);
+}
+
+static inline int avio_readahead_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    AVIOReadAheadStream *s = (AVIOReadAheadStream *)opaque;
+    AVIOReadAheadEngine *e = s->engine;
+    int done = 0, ret = 0;
+
+    pthread_mutex_lock(&e->lock);
+    if (s->pos < s->window_pos ||
+        s->pos >= s->window_pos + (int64_t)s->window * s->block_size) {
+        e->stats.seeks++;
+        avio_readahead_reset(s, s->pos);
+    }
+
+    while (done < buf_size && s->pos < s->file_size) {
+        AVIOReadAheadBlock *b;
+        int offset, n;
+
+        while (s->pos >= s->window_pos + s->block_size)
+            avio_readahead_advance(s);
+        b = &s->blocks[s->first];
+
+        if (b->state != AVIO_READAHEAD_READY) {
+            if (done)
+                break;
+            e->stats.stalls++;
+            while (b->state != AVIO_READAHEAD_READY)
+                pthread_cond_wait(&s->ready, &e->lock);
+        }
+        if (b->err < 0) {
+            ret = b->err;
+            break;
+        }
+
+        offset = (int)(s->pos - s->window_pos);
+        n = FFMIN(buf_size - done, b->size - offset);
+        if (n <= 0)
+            break;
+
+        memcpy(buf + done, b->data + offset, n);
+        done += n;
+        s->pos += n;
+
+    }
+    pthread_mutex_unlock(&e->lock);
+
+    if (done)
+        return done;
+    return ret < 0 ? ret : AVERROR_EOF;
+}
+
+static inline int64_t avio_readahead_seek(void *opaque, int64_t offset, int whence)
+{
+    AVIOReadAheadStream *s = (AVIOReadAheadStream *)opaque;
+    int64_t pos;
+
+    if (whence & AVSEEK_SIZE)
+        return s->file_size;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET: pos = offset;                break;
+    case SEEK_CUR: pos = s->pos + offset;       break;
+    case SEEK_END: pos = s->file_size + offset; break;
+    default:       return AVERROR(EINVAL);
+    }
+    if (pos < 0)
+        return AVERROR(EINVAL);
+
+    /* The window is retargeted lazily by the next read. */
+    pthread_mutex_lock(&s->engine->lock);
+    s->pos = pos;
+    pthread_mutex_unlock(&s->engine->lock);
+    return pos;
+}
+
+/**
+ * Start an I/O engine.
+ *
+ * @param nb_threads number of I/O threads, 0 for 1
+ * @return the engine, or NULL on failure
+ */
+static inline AVIOReadAheadEngine *avio_readahead_engine_alloc(int nb_threads)
+{
+    AVIOReadAheadEngine *e = (AVIOReadAheadEngine *)av_mallocz(sizeof(*e));
+    int i;
+
+    if (!e)
+        return NULL;
+    e->nb_threads = nb_threads > 0 ? nb_threads : 1;
+    e->threads = (pthread_t *)av_calloc(e->nb_threads, sizeof(*e->threads));
+    if (!e->threads) {
+        av_free(e);
+        return NULL;
+    }
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->work, NULL);
+
+    for (i = 0; i < e->nb_threads; i++) {
+        if (pthread_create(&e->threads[i], NULL, avio_readahead_worker, e)) {
+            e->nb_threads = i;
+            break;
+        }
+    }
+    if (!e->nb_threads) {
+        pthread_cond_destroy(&e->work);
+        pthread_mutex_destroy(&e->lock);
+        av_free(e->threads);
+        av_free(e);
+        return NULL;
+    }
+    return e;
+}
+
+/**
+ * Stop the engine threads and free the engine. Every context opened on it
+ * must have been closed with avio_readahead_close() first.
+ */
+static inline void avio_readahead_engine_free(AVIOReadAheadEngine **pe)
+{
+    AVIOReadAheadEngine *e = *pe;
+    int i;
+
+    if (!e)
+        return;
+    pthread_mutex_lock(&e->lock);
+    e->quit = 1;
+    pthread_cond_broadcast(&e->work);
+    pthread_mutex_unlock(&e->lock);
+    for (i = 0; i < e->nb_threads; i++)
+        pthread_join(e->threads[i], NULL);
+    pthread_cond_destroy(&e->work);
+    pthread_mutex_destroy(&e->lock);
+    av_freep(&e->threads);
+    av_freep(pe);
+}
+
+static inline void avio_readahead_get_stats(AVIOReadAheadEngine *e, AVIOReadAheadStats *stats)
+{
+    pthread_mutex_lock(&e->lock);
+    *stats = e->stats;
+    pthread_mutex_unlock(&e->lock);
+}
+
+static inline void avio_readahead_stream_free(AVIOReadAheadStream *s)
+{
+    AVIOReadAheadEngine *e = s->engine;
+    AVIOReadAheadBlock **link;
+    int i;
+
+    pthread_mutex_lock(&e->lock);
+    /* Drop queued blocks, then wait for the ones being read; closing keeps
+     * a block retargeted during its read from going back on the queue. */
+    s->closing = 1;
+    e->tail = NULL;
+    for (link = &e->head; *link; ) {
+        if ((*link)->stream == s) {
+            (*link)->state = AVIO_READAHEAD_IDLE;
+            *link = (*link)->next;
+        } else {
+            e->tail = *link;
+            link = &(*link)->next;
+        }
+    }
+    while (s->reading > 0)
+        pthread_cond_wait(&s->ready, &e->lock);
+    pthread_mutex_unlock(&e->lock);
+
+    if (s->blocks) {
+        for (i = 0; i < s->window; i++)
+            free(s->blocks[i].data);
+        av_free(s->blocks);
+    }
+    pthread_cond_destroy(&s->ready);
+    if (s->fd >= 0)
+        close(s->fd);
+    av_free(s);
+}
+
+/**
+ * Open a file for reading through the engine.
+ *
+ * @param pb          set to the new AVIOContext on success
+ * @param engine      I/O engine to schedule the reads on
+ * @param filename    path of a local file
+ * @param flags       AVIO_FLAG_READ, optionally with AVIO_FLAG_DIRECT
+ * @param block_size  read-ahead block size, 0 for the default; rounded up to
+ *                    a multiple of AVIO_READAHEAD_ALIGN
+ * @param window      number of blocks kept in flight, 0 for the default
+ * @return >= 0 on success, a negative AVERROR code on failure
+ */
+static inline int avio_readahead_open(AVIOContext **pb, AVIOReadAheadEngine *engine,
+                                      const char *filename, int flags,
+                                      int block_size, int window)
+{
+    AVIOReadAheadStream *s;
+    struct stat st;
+    uint8_t *buffer;
+    int open_flags = O_RDONLY;
+    int i, ret;
+
+    *pb = NULL;
+    if (!engine || (flags & AVIO_FLAG_WRITE))
+        return AVERROR(EINVAL);
+
+    s = (AVIOReadAheadStream *)av_mallocz(sizeof(*s));
+    if (!s)
+        return AVERROR(ENOMEM);
+    s->engine = engine;
+    s->fd = -1;
+    pthread_cond_init(&s->ready, NULL);
+
+    if (block_size <= 0)
+        block_size = AVIO_READAHEAD_DEFAULT_BLOCK;
+    s->block_size = FFALIGN(block_size, AVIO_READAHEAD_ALIGN);
+    s->window = window > 0 ? window : AVIO_READAHEAD_DEFAULT_WINDOW;
+
+#if defined(O_DIRECT)
+    if (flags & AVIO_FLAG_DIRECT) {
+        open_flags |= O_DIRECT;
+        s->direct = 1;
+    }
+#endif
+#if defined(O_CLOEXEC)
+    open_flags |= O_CLOEXEC;
+#endif
+    s->fd = open(filename, open_flags);
+    if (s->fd < 0 || fstat(s->fd, &st) < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    s->file_size = st.st_size;
+#if defined(F_NOCACHE)
+    if (flags & AVIO_FLAG_DIRECT)
+        fcntl(s->fd, F_NOCACHE, 1);
+#endif
+#if defined(F_RDAHEAD)
+    /* The engine does its own read-ahead. */
+    fcntl(s->fd, F_RDAHEAD, 0);
+#endif
+
+    s->blocks = (AVIOReadAheadBlock *)av_calloc(s->window, sizeof(*s->blocks));
+    if (!s->blocks) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    for (i = 0; i < s->window; i++) {
+        void *data;
+        if (posix_memalign(&data, AVIO_READAHEAD_ALIGN, s->block_size)) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        s->blocks[i].data = (uint8_t *)data;
+        s->blocks[i].stream = s;
+    }
+
+    buffer = (uint8_t *)av_malloc(32768);
+    if (!buffer) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    *pb = avio_alloc_context(buffer, 32768, 0, s, avio_readahead_read_packet,
+                             NULL, avio_readahead_seek);
+    if (!*pb) {
+        av_free(buffer);
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    avio_readahead_reset(s, 0);
+    pthread_mutex_unlock(&engine->lock);
+    return 0;
+
+fail:
+    avio_readahead_stream_free(s);
+    return ret;
+}
+
+/**
+ * Close a context opened with avio_readahead_open() and set *pb to NULL.
+ */
+static inline int avio_readahead_close(AVIOContext **pb)
+{
+    AVIOReadAheadStream *s;
+
+    if (!*pb)
+        return 0;
+    s = (AVIOReadAheadStream *)(*pb)->opaque;
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+    avio_readahead_stream_free(s);
+    return 0;
+}
+
+#endif /* AVFORMAT_AVIO_READAHEAD_H */
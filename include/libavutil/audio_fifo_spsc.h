@@ -0,0 +1,376 @@
+/*
+ * Lock-free single-producer/single-consumer Audio FIFO
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Lock-free SPSC Audio FIFO Buffer
+ */
+
+#ifndef AVUTIL_AUDIO_FIFO_SPSC_H
+#define AVUTIL_AUDIO_FIFO_SPSC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avutil.h"
+#include "mem.h"
+#include "samplefmt.h"
+#include "spsc_wait.h"
+
+/**
+ * @addtogroup lavu_audiofifo
+ * @{
+ */
+
+/**
+ * Audio FIFO for exactly one writing thread and one reading thread.
+ *
+ * Works like AVAudioFifo (sample level, planar or packed), but needs no
+ * external lock:
+ * - capacity is fixed at allocation and rounded up to a power of two, at
+ *   most AV_AUDIO_FIFO_SPSC_MAX_CAPACITY so sample counts fit in an int;
+ * - av_audio_fifo_spsc_write() and av_audio_fifo_spsc_read() are
+ *   wait-free and move as many samples as fit or are available;
+ * - the _wait variants spin, then block until the whole request is done
+ *   or the FIFO was closed.
+ *
+ * Functions marked producer must only be called from the writing thread,
+ * those marked consumer only from the reading thread.
+ */
+#define AV_AUDIO_FIFO_SPSC_MAX_CAPACITY (1 << 30)
+
+typedef struct AVAudioFifoSPSC {
+    uint8_t **buf;
+    int nb_buffers;
+    int sample_size;
+    uint64_t capacity;
+    uint64_t mask;
+    int closed;
+    AVSPSCWait data;    ///< consumer sleeps here
+    AVSPSCWait space;   ///< producer sleeps here
+
+    /* producer cache line */
+    uint64_t write_pos   __attribute__((aligned(AV_SPSC_CACHELINE)));
+    uint64_t cached_read;
+
+    /* consumer cache line */
+    uint64_t read_pos    __attribute__((aligned(AV_SPSC_CACHELINE)));
+    uint64_t cached_write;
+} AVAudioFifoSPSC;
+
+/**
+ * Free an AVAudioFifoSPSC. Neither thread may use it any more.
+ */
+static inline void av_audio_fifo_spsc_free(AVAudioFifoSPSC *af)
+{
+    int i;
+
+    if (!af)
+        return;
+    if (af->buf) {
+        for (i = 0; i < af->nb_buffers; i++)
+            av_free(af->buf[i]);
+        av_free(af->buf);
+    }
+    av_spsc_wait_uninit(&af->data);
+    av_spsc_wait_uninit(&af->space);
+    free(af);
+}
+
+/**
+ * Allocate an AVAudioFifoSPSC.
+ *
+ * @param sample_fmt  sample format
+ * @param channels    number of channels
+ * @param nb_samples  minimum capacity in samples, clamped to
+ *                    AV_AUDIO_FIFO_SPSC_MAX_CAPACITY
+ * @param spin        polls before a waiting thread sleeps, <0 for the default,
+ *                    0 to block immediately
+ * @return            newly allocated AVAudioFifoSPSC, or NULL on error
+ */
+static inline AVAudioFifoSPSC *av_audio_fifo_spsc_alloc(enum AVSampleFormat sample_fmt,
+                                                        int channels, int nb_samples,
+                                                        int spin)
+{
+    AVAudioFifoSPSC *af;
+    void *mem;
+    uint64_t capacity = 1;
+    int i, bps = av_get_bytes_per_sample(sample_fmt);
+
+    if (bps <= 0 || channels <= 0 || nb_samples <= 0)
+        return NULL;
+    while (capacity < (uint64_t)FFMIN(nb_samples, AV_AUDIO_FIFO_SPSC_MAX_CAPACITY))
+        capacity <<= 1;
+
+    if (posix_memalign(&mem, AV_SPSC_CACHELINE, sizeof(*af)))
+        return NULL;
+    af = (AVAudioFifoSPSC *)mem;
+    memset(af, 0, sizeof(*af));
+
+    if (av_spsc_wait_init(&af->data, spin) < 0) {
+        free(af);
+        return NULL;
+    }
+    if (av_spsc_wait_init(&af->space, spin) < 0) {
+        av_spsc_wait_uninit(&af->data);
+        free(af);
+        return NULL;
+    }
+
+    af->capacity    = capacity;
+    af->mask        = capacity - 1;
+    af->nb_buffers  = av_sample_fmt_is_planar(sample_fmt) ? channels : 1;
+    af->sample_size = av_sample_fmt_is_planar(sample_fmt) ? bps : bps * channels;
+    af->buf = (uint8_t **)av_calloc(af->nb_buffers, sizeof(*af->buf));
+    if (!af->buf)
+        goto fail;
+    for (i = 0; i < af->nb_buffers; i++) {
+        af->buf[i] = (uint8_t *)av_malloc(capacity * af->sample_size);
+        if (!af->buf[i])
+            goto fail;
+    }
+    return af;
+
+fail:
+    av_audio_fifo_spsc_free(af);
+    return NULL;
+}
+
+static inline void av_audio_fifo_spsc_copy(AVAudioFifoSPSC *af, void **data,
+                                           uint64_t pos, int nb_samples, int to_fifo)
+{
+    uint64_t start = pos & af->mask;
+    size_t first  = (size_t)FFMIN((uint64_t)nb_samples, af->capacity - start) * af->sample_size;
+    size_t total  = (size_t)nb_samples * af->sample_size;
+    size_t offset = (size_t)start * af->sample_size;
+    int i;
+
+    for (i = 0; i < af->nb_buffers; i++) {
+        uint8_t *ext = (uint8_t *)data[i];
+        if (to_fifo) {
+            memcpy(af->buf[i] + offset, ext, first);
+            memcpy(af->buf[i], ext + first, total - first);
+        } else {
+            memcpy(ext, af->buf[i] + offset, first);
+            memcpy(ext + first, af->buf[i], total - first);
+        }
+    }
+}
+
+/**
+ * Producer: number of samples that can be written without blocking.
+ */
+static inline int av_audio_fifo_spsc_space(AVAudioFifoSPSC *af)
+{
+    af->cached_read = av_spsc_load(&af->read_pos);
+    return (int)(af->capacity - (af->write_pos - af->cached_read));
+}
+
+/**
+ * Consumer: number of samples that can be read without blocking.
+ */
+static inline int av_audio_fifo_spsc_size(AVAudioFifoSPSC *af)
+{
+    af->cached_write = av_spsc_load(&af->write_pos);
+    return (int)(af->cached_write - af->read_pos);
+}
+
+/**
+ * Producer: write as many samples as currently fit. Wait-free.
+ *
+ * @param data  audio data plane pointers
+ * @return      number of samples written, possibly less than nb_samples
+ */
+static inline int av_audio_fifo_spsc_write(AVAudioFifoSPSC *af, void **data, int nb_samples)
+{
+    uint64_t free_space = af->capacity - (af->write_pos - af->cached_read);
+
+    if (free_space < (uint64_t)nb_samples)
+        free_space = (uint64_t)av_audio_fifo_spsc_space(af);
+    nb_samples = (int)FFMIN((uint64_t)nb_samples, free_space);
+    if (nb_samples <= 0)
+        return 0;
+
+    av_audio_fifo_spsc_copy(af, data, af->write_pos, nb_samples, 1);
+    av_spsc_store(&af->write_pos, af->write_pos + nb_samples);
+    av_spsc_wake(&af->data);
+    return nb_samples;
+}
+
+/**
+ * Consumer: copy up to nb_samples without removing them. Wait-free.
+ *
+ * @return number of samples peeked
+ */
+static inline int av_audio_fifo_spsc_peek(AVAudioFifoSPSC *af, void **data, int nb_samples)
+{
+    uint64_t avail = af->cached_write - af->read_pos;
+
+    if (avail < (uint64_t)nb_samples)
+        avail = (uint64_t)av_audio_fifo_spsc_size(af);
+    nb_samples = (int)FFMIN((uint64_t)nb_samples, avail);
+    if (nb_samples <= 0)
+        return 0;
+
+    av_audio_fifo_spsc_copy(af, data, af->read_pos, nb_samples, 0);
+    return nb_samples;
+}
+
+/**
+ * Consumer: remove up to nb_samples without copying them.
+ *
+ * @return number of samples drained
+ */
+static inline int av_audio_fifo_spsc_drain(AVAudioFifoSPSC *af, int nb_samples)
+{
+    uint64_t avail = af->cached_write - af->read_pos;
+
+    if (avail < (uint64_t)nb_samples)
+        avail = (uint64_t)av_audio_fifo_spsc_size(af);
+    nb_samples = (int)FFMIN((uint64_t)nb_samples, avail);
+    if (nb_samples <= 0)
+        return 0;
+
+    av_spsc_store(&af->read_pos, af->read_pos + nb_samples);
+    av_spsc_wake(&af->space);
+    return nb_samples;
+}
+
+/**
+ * Consumer: read up to nb_samples. Wait-free.
+ *
+ * @return number of samples read, possibly less than nb_samples
+ */
+static inline int av_audio_fifo_spsc_read(AVAudioFifoSPSC *af, void **data, int nb_samples)
+{
+    nb_samples = av_audio_fifo_spsc_peek(af, data, nb_samples);
+    if (nb_samples > 0)
+        av_audio_fifo_spsc_drain(af, nb_samples);
+    return nb_samples;
+}
+
+/**
+ * Either thread: mark the end of the stream and wake the other thread.
+ * The consumer still gets the samples already written; a producer
+ * blocked in av_audio_fifo_spsc_write_wait() returns, for instance when
+ * the consumer stops reading.
+ */
+static inline void av_audio_fifo_spsc_close(AVAudioFifoSPSC *af)
+{
+    av_spsc_store(&af->closed, 1);
+    av_spsc_wake(&af->data);
+    av_spsc_wake(&af->space);
+}
+
+typedef struct AVAudioFifoSPSCWaitArg {
+    AVAudioFifoSPSC *af;
+    int nb_samples;
+} AVAudioFifoSPSCWaitArg;
+
+static inline int av_audio_fifo_spsc_has_space(void *opaque)
+{
+    AVAudioFifoSPSCWaitArg *arg = (AVAudioFifoSPSCWaitArg *)opaque;
+    return av_audio_fifo_spsc_space(arg->af) >= arg->nb_samples ||
+           av_spsc_load(&arg->af->closed);
+}
+
+static inline int av_audio_fifo_spsc_has_data(void *opaque)
+{
+    AVAudioFifoSPSCWaitArg *arg = (AVAudioFifoSPSCWaitArg *)opaque;
+    return av_audio_fifo_spsc_size(arg->af) >= arg->nb_samples ||
+           av_spsc_load(&arg->af->closed);
+}
+
+/**
+ * Producer: write all nb_samples, waiting for space as needed.
+ *
+ * @return nb_samples; if the FIFO was closed, the samples written before
+ *         (fewer than requested), or AVERROR_EOF if there were none
+ */
+static inline int av_audio_fifo_spsc_write_wait(AVAudioFifoSPSC *af, void **data,
+                                                int nb_samples)
+{
+    uint8_t *planes[64];
+    int i, done = 0;
+
+    if (af->nb_buffers > 64)
+        return AVERROR(EINVAL);
+
+    while (done < nb_samples) {
+        AVAudioFifoSPSCWaitArg arg = { af, 0 };
+
+        if (av_spsc_load(&af->closed))
+            return done ? done : AVERROR_EOF;
+        for (i = 0; i < af->nb_buffers; i++)
+            planes[i] = (uint8_t *)data[i] + (size_t)done * af->sample_size;
+        done += av_audio_fifo_spsc_write(af, (void **)planes, nb_samples - done);
+        if (done == nb_samples)
+            break;
+        arg.nb_samples = FFMIN(nb_samples - done, (int)af->capacity);
+        av_spsc_wait(&af->space, av_audio_fifo_spsc_has_space, &arg);
+    }
+    return done;
+}
+
+/**
+ * Consumer: read exactly nb_samples, waiting for data as needed.
+ *
+ * @return nb_samples; after av_audio_fifo_spsc_close() the remaining
+ *         samples (fewer than requested), then AVERROR_EOF
+ */
+static inline int av_audio_fifo_spsc_read_wait(AVAudioFifoSPSC *af, void **data,
+                                               int nb_samples)
+{
+    AVAudioFifoSPSCWaitArg arg = { af, FFMIN(nb_samples, (int)af->capacity) };
+    uint8_t *planes[64];
+    int i, done = 0;
+
+    if (nb_samples <= 0)
+        return 0;
+    if (af->nb_buffers > 64)
+        return AVERROR(EINVAL);
+
+    while (done < nb_samples) {
+        int n;
+
+        for (i = 0; i < af->nb_buffers; i++)
+            planes[i] = (uint8_t *)data[i] + (size_t)done * af->sample_size;
+        n = av_audio_fifo_spsc_read(af, (void **)planes, nb_samples - done);
+        done += n;
+        if (done == nb_samples)
+            break;
+        if (!n && av_spsc_load(&af->closed)) {
+            /* Closed: the producer's last write is visible, drain it. */
+            if (!av_audio_fifo_spsc_size(af))
+                break;
+            continue;
+        }
+        arg.nb_samples = FFMIN(nb_samples - done, (int)af->capacity);
+        av_spsc_wait(&af->data, av_audio_fifo_spsc_has_data, &arg);
+    }
+    return done ? done : AVERROR_EOF;
+}
+
+/**
+ * @}
+ */
+
+#endif /* AVUTIL_AUDIO_FIFO_SPSC_H */
@@ -0,0 +1,408 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * @ingroup lavu_bufferpool
+ * Sharded buffer pool for many-threaded decoding and filtering.
+ */
+
+#ifndef AVUTIL_BUFFER_SHARDED_H
+#define AVUTIL_BUFFER_SHARDED_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "cacheline.h"
+#include "error.h"
+#include "mem.h"
+
+/**
+ * @addtogroup lavu_bufferpool
+ * @{
+ *
+ * AVBufferPoolSharded works like AVBufferPool, but splits the free list into
+ * shards, each with its own lock on its own cache line, backed by a global
+ * overflow list.
+ *
+ * By default every thread gets a process-wide number on its first
+ * av_buffer_pool_sharded_get() call and uses shard number % nb_shards of
+ * every pool, so threads are spread round-robin without any per-pool
+ * thread state. Callers that know their
+ * topology (one shard per NUMA node, per frame thread, ...) can pick the
+ * shard explicitly with av_buffer_pool_sharded_get_shard().
+ *
+ * A released buffer goes back to the shard it was handed out from, so memory
+ * stays with the node that last touched it. A shard keeps at most
+ * max_per_shard free buffers; the rest spill to the overflow list, which any
+ * shard drains before allocating. Free buffers are released as soon as the
+ * pool is uninitialized; those still in use when it is are freed as they
+ * come back.
+ *
+ * The returned AVBufferRef behaves exactly like one from av_buffer_pool_get().
+ */
+
+typedef struct AVBufferPoolShardedEntry {
+    AVBufferRef *orig;
+    struct AVBufferPoolSharded *pool;
+    struct AVBufferPoolShardedEntry *next;
+    int shard;
+} AVBufferPoolShardedEntry;
+
+typedef struct AVBufferPoolShard {
+    pthread_mutex_t lock;
+    AVBufferPoolShardedEntry *free_list;
+    int nb_free;
+    uint64_t hits;
+} __attribute__((aligned(AV_CACHELINE))) AVBufferPoolShard;
+
+/**
+ * Pool statistics, see av_buffer_pool_sharded_get_stats().
+ */
+typedef struct AVBufferPoolShardedStats {
+    uint64_t shard_hits;     ///< gets served from the caller's shard
+    uint64_t overflow_hits;  ///< gets served from the overflow list
+    uint64_t misses;         ///< gets that had to allocate
+    int64_t  in_use;         ///< buffers currently handed out
+    int64_t  peak_in_use;    ///< highest value of in_use so far
+    int64_t  allocated;      ///< buffers owned by the pool, free or in use
+} AVBufferPoolShardedStats;
+
+typedef struct AVBufferPoolSharded {
+    AVBufferPoolShard *shards;
+    int nb_shards;
+    int max_per_shard;
+    size_t size;
+
+    void *opaque;
+    AVBufferRef *(*alloc)(size_t size);
+    AVBufferRef *(*alloc2)(void *opaque, size_t size);
+    void (*pool_free)(void *opaque);
+
+    int uninit;              ///< release frees buffers instead of keeping them
+
+    pthread_mutex_t overflow_lock;
+    AVBufferPoolShardedEntry *overflow;
+    uint64_t overflow_hits;
+    uint64_t misses;
+
+    int64_t in_use;
+    int64_t peak_in_use;
+    int64_t allocated;
+
+    /* one reference for the owner plus one per buffer handed out */
+    int refcount;
+} AVBufferPoolSharded;
+
+static inline void av_buffer_pool_sharded_free_entries(AVBufferPoolSharded *pool,
+                                                       AVBufferPoolShardedEntry *e)
+{
+    AVBufferPoolShardedEntry *next;
+
+    for (; e; e = next) {
+        next = e->next;
+        av_buffer_unref(&e->orig);
+        av_free(e);
+        __atomic_sub_fetch(&pool->allocated, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Free every idle buffer, shard by shard, then the overflow list. */
+static inline void av_buffer_pool_sharded_flush(AVBufferPoolSharded *pool)
+{
+    AVBufferPoolShardedEntry *e;
+    int i;
+
+    for (i = 0; i < pool->nb_shards; i++) {
+        AVBufferPoolShard *s = &pool->shards[i];
+
+        pthread_mutex_lock(&s->lock);
+        e            = s->free_list;
+        s->free_list = NULL;
+        s->nb_free   = 0;
+        pthread_mutex_unlock(&s->lock);
+        av_buffer_pool_sharded_free_entries(pool, e);
+    }
+
+    pthread_mutex_lock(&pool->overflow_lock);
+    e = pool->overflow;
+    __atomic_store_n(&pool->overflow, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->overflow_lock);
+    av_buffer_pool_sharded_free_entries(pool, e);
+}
+
+static inline void av_buffer_pool_sharded_destroy(AVBufferPoolSharded *pool)
+{
+    int i;
+
+    av_buffer_pool_sharded_flush(pool);
+    for (i = 0; i < pool->nb_shards; i++)
+        pthread_mutex_destroy(&pool->shards[i].lock);
+    pthread_mutex_destroy(&pool->overflow_lock);
+    free(pool->shards);
+
+    if (pool->pool_free)
+        pool->pool_free(pool->opaque);
+    av_free(pool);
+}
+
+static inline void av_buffer_pool_sharded_unref(AVBufferPoolSharded *pool)
+{
+    if (__atomic_sub_fetch(&pool->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        av_buffer_pool_sharded_destroy(pool);
+}
+
+/**
+ * Allocate and initialize a sharded buffer pool.
+ *
+ * @param size          size of each buffer in this pool
+ * @param nb_shards     number of shards, e.g. number of NUMA nodes or
+ *                      decoding threads; <= 0 selects 1
+ * @param max_per_shard free buffers a shard keeps before spilling to the
+ *                      overflow list; <= 0 means unlimited
+ * @param opaque        arbitrary user data passed to alloc and pool_free
+ * @param alloc         allocator as in av_buffer_pool_init2(), may be NULL
+ * @param pool_free     called once the pool is actually freed, may be NULL
+ * @return newly created pool on success, NULL on error
+ */
+static inline AVBufferPoolSharded *av_buffer_pool_sharded_init2(size_t size, int nb_shards,
+                                                               int max_per_shard, void *opaque,
+                                                               AVBufferRef *(*alloc)(void *opaque, size_t size),
+                                                               void (*pool_free)(void *opaque))
+{
+    AVBufferPoolSharded *pool = (AVBufferPoolSharded *)av_mallocz(sizeof(*pool));
+    void *mem;
+    int i;
+
+    if (!pool)
+        return NULL;
+    if (nb_shards <= 0)
+        nb_shards = 1;
+
+    if (posix_memalign(&mem, AV_CACHELINE, nb_shards * sizeof(*pool->shards))) {
+        av_free(pool);
+        return NULL;
+    }
+    pool->shards = (AVBufferPoolShard *)mem;
+    memset(pool->shards, 0, nb_shards * sizeof(*pool->shards));
+
+    for (i = 0; i < nb_shards; i++)
+        pthread_mutex_init(&pool->shards[i].lock, NULL);
+    pthread_mutex_init(&pool->overflow_lock, NULL);
+
+    pool->nb_shards     = nb_shards;
+    pool->max_per_shard = max_per_shard;
+    pool->size          = size;
+    pool->opaque        = opaque;
+    pool->alloc2        = alloc;
+    pool->alloc         = av_buffer_alloc;
+    pool->pool_free     = pool_free;
+    pool->refcount      = 1;
+    return pool;
+}
+
+/**
+ * Allocate and initialize a sharded buffer pool with a simple allocator.
+ *
+ * @see av_buffer_pool_sharded_init2()
+ */
+static inline AVBufferPoolSharded *av_buffer_pool_sharded_init(size_t size, int nb_shards,
+                                                              AVBufferRef *(*alloc)(size_t size))
+{
+    AVBufferPoolSharded *pool = av_buffer_pool_sharded_init2(size, nb_shards, 0,
+                                                             NULL, NULL, NULL);
+    if (pool && alloc)
+        pool->alloc = alloc;
+    return pool;
+}
+
+/**
+ * Mark the pool as being available for freeing and free its idle buffers.
+ * It is actually freed once all buffers obtained from it are released.
+ *
+ * @param ppool pointer to the pool to be freed. It will be set to NULL.
+ */
+static inline void av_buffer_pool_sharded_uninit(AVBufferPoolSharded **ppool)
+{
+    AVBufferPoolSharded *pool = *ppool;
+
+    if (!pool)
+        return;
+    *ppool = NULL;
+    __atomic_store_n(&pool->uninit, 1, __ATOMIC_RELAXED);
+    av_buffer_pool_sharded_flush(pool);
+    av_buffer_pool_sharded_unref(pool);
+}
+
+static inline void av_buffer_pool_sharded_release(void *opaque, uint8_t *data)
+{
+    AVBufferPoolShardedEntry *e = (AVBufferPoolShardedEntry *)opaque;
+    AVBufferPoolSharded *pool  = e->pool;
+    AVBufferPoolShard *shard   = &pool->shards[e->shard];
+
+    (void)data;
+    __atomic_sub_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&pool->uninit, __ATOMIC_RELAXED)) {
+        e->next = NULL;
+        av_buffer_pool_sharded_free_entries(pool, e);
+        av_buffer_pool_sharded_unref(pool);
+        return;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    if (pool->max_per_shard <= 0 || shard->nb_free < pool->max_per_shard) {
+        e->next          = shard->free_list;
+        shard->free_list = e;
+        shard->nb_free++;
+        e = NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (e) {
+        pthread_mutex_lock(&pool->overflow_lock);
+        e->next = pool->overflow;
+        __atomic_store_n(&pool->overflow, e, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&pool->overflow_lock);
+    }
+
+    av_buffer_pool_sharded_unref(pool);
+}
+
+/**
+ * Get a buffer from the given shard, falling back to the overflow list and
+ * then to the allocator.
+ *
+ * @param shard index in [0, nb_shards), taken modulo nb_shards
+ * @return a reference to the buffer on success, NULL on error
+ */
+static inline AVBufferRef *av_buffer_pool_sharded_get_shard(AVBufferPoolSharded *pool,
+                                                           int shard)
+{
+    AVBufferPoolShardedEntry *e;
+    AVBufferPoolShard *s;
+    AVBufferRef *ret;
+    int64_t in_use, peak;
+
+    shard = (unsigned)shard % (unsigned)pool->nb_shards;
+    s     = &pool->shards[shard];
+
+    pthread_mutex_lock(&s->lock);
+    e = s->free_list;
+    if (e) {
+        s->free_list = e->next;
+        s->nb_free--;
+        s->hits++;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (!e && __atomic_load_n(&pool->overflow, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&pool->overflow_lock);
+        e = pool->overflow;
+        if (e) {
+            __atomic_store_n(&pool->overflow, e->next, __ATOMIC_RELAXED);
+            pool->overflow_hits++;
+        }
+        pthread_mutex_unlock(&pool->overflow_lock);
+    }
+
+    if (!e) {
+        e = (AVBufferPoolShardedEntry *)av_mallocz(sizeof(*e));
+        if (!e)
+            return NULL;
+        e->orig = pool->alloc2 ? pool->alloc2(pool->opaque, pool->size)
+                               : pool->alloc(pool->size);
+        if (!e->orig) {
+            av_free(e);
+            return NULL;
+        }
+        e->pool = pool;
+        __atomic_add_fetch(&pool->misses, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&pool->allocated, 1, __ATOMIC_RELAXED);
+    }
+    /* the buffer belongs to the shard it is handed out from now on */
+    e->shard = shard;
+
+    ret = av_buffer_create(e->orig->data, pool->size,
+                           av_buffer_pool_sharded_release, e, 0);
+    if (!ret) {
+        pthread_mutex_lock(&pool->overflow_lock);
+        e->next = pool->overflow;
+        __atomic_store_n(&pool->overflow, e, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&pool->overflow_lock);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&pool->refcount, 1, __ATOMIC_RELAXED);
+    in_use = __atomic_add_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+    peak   = __atomic_load_n(&pool->peak_in_use, __ATOMIC_RELAXED);
+    while (in_use > peak &&
+           !__atomic_compare_exchange_n(&pool->peak_in_use, &peak, in_use, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return ret;
+}
+
+/**
+ * Get a buffer from the calling thread's shard.
+ *
+ * @return a reference to the buffer on success, NULL on error
+ */
+static inline AVBufferRef *av_buffer_pool_sharded_get(AVBufferPoolSharded *pool)
+{
+    /* numbered from 1, 0 = not numbered yet */
+    static unsigned next_thread;
+    static __thread unsigned thread;
+
+    while (!thread)
+        thread = __atomic_add_fetch(&next_thread, 1, __ATOMIC_RELAXED);
+    return av_buffer_pool_sharded_get_shard(pool, (int)((thread - 1) % (unsigned)pool->nb_shards));
+}
+
+/**
+ * Read the pool statistics. Counters are sampled without a global lock and
+ * are only mutually consistent when the pool is idle.
+ */
+static inline void av_buffer_pool_sharded_get_stats(AVBufferPoolSharded *pool,
+                                                    AVBufferPoolShardedStats *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < pool->nb_shards; i++) {
+        pthread_mutex_lock(&pool->shards[i].lock);
+        stats->shard_hits += pool->shards[i].hits;
+        pthread_mutex_unlock(&pool->shards[i].lock);
+    }
+    pthread_mutex_lock(&pool->overflow_lock);
+    stats->overflow_hits = pool->overflow_hits;
+    pthread_mutex_unlock(&pool->overflow_lock);
+    stats->misses      = __atomic_load_n(&pool->misses, __ATOMIC_RELAXED);
+    stats->in_use      = __atomic_load_n(&pool->in_use, __ATOMIC_RELAXED);
+    stats->peak_in_use = __atomic_load_n(&pool->peak_in_use, __ATOMIC_RELAXED);
+    stats->allocated   = __atomic_load_n(&pool->allocated, __ATOMIC_RELAXED);
+}
+
+/**
+ * @}
+ */
+
+#endif /* AVUTIL_BUFFER_SHARDED_H */
@@ -0,0 +1,432 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * @ingroup lavu_frame
+ * Copy-on-write frame handoff with streaming and threaded image copies.
+ */
+
+#ifndef AVUTIL_FRAME_COW_H
+#define AVUTIL_FRAME_COW_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "error.h"
+#include "frame.h"
+#include "imgutils.h"
+#include "mem.h"
+#include "pixdesc.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * @addtogroup lavu_frame
+ * @{
+ *
+ * Stages should hand frames to each other with av_frame_ref() or
+ * av_frame_move_ref() and never copy up front. A stage that needs to write
+ * calls av_frame_cow_make_writable(), which copies only if the buffers are
+ * still shared. When a copy is needed:
+ *
+ * - frames of at least nt_threshold bytes are copied with non-temporal
+ *   (streaming) stores, so the source and destination do not evict the
+ *   working set of the stage that is about to run;
+ * - frames of at least thread_threshold bytes are split by rows across the
+ *   context's worker threads, which pays off at 4K and 8K.
+ *
+ * An AVFrameCOWContext must not be used by several threads at once. Use one
+ * per pipeline stage.
+ */
+
+#define AV_FRAME_COW_MAX_THREADS 16
+
+typedef struct AVFrameCOWStats {
+    uint64_t writable_hits;    ///< av_frame_cow_make_writable() calls that did not copy
+    uint64_t copies;           ///< image copies performed
+    uint64_t nt_copies;        ///< copies that used streaming stores
+    uint64_t threaded_copies;  ///< copies split across threads
+    uint64_t bytes_copied;
+} AVFrameCOWStats;
+
+typedef struct AVFrameCOWJob {
+    uint8_t       *dst[4];
+    const uint8_t *src[4];
+    ptrdiff_t      dst_linesize[4];
+    ptrdiff_t      src_linesize[4];
+    int            bytewidth[4];
+    int            height[4];
+    int            nb_planes;
+    int            nb_tasks;
+    int            nt;
+} AVFrameCOWJob;
+
+typedef struct AVFrameCOWContext AVFrameCOWContext;
+
+typedef struct AVFrameCOWWorker {
+    AVFrameCOWContext *ctx;
+    pthread_t          thread;
+    int                index;
+} AVFrameCOWWorker;
+
+struct AVFrameCOWContext {
+    size_t nt_threshold;
+    size_t thread_threshold;
+
+    int              nb_threads;
+    AVFrameCOWWorker workers[AV_FRAME_COW_MAX_THREADS];
+    pthread_mutex_t  lock;
+    pthread_cond_t   work_cond;
+    pthread_cond_t   done_cond;
+    AVFrameCOWJob    job;
+    unsigned         generation;
+    int              pending;
+    int              quit;
+
+    AVFrameCOWStats  stats;
+};
+
+/**
+ * Copy one line with streaming stores where the CPU has them.
+ */
+static inline void av_frame_cow_copy_line_nt(uint8_t *dst, const uint8_t *src, size_t n)
+{
+#if defined(__SSE2__)
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+
+    if (n < 64 + head) {
+        memcpy(dst, src, n);
+        return;
+    }
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    n   -= head;
+    for (; n >= 64; n -= 64, src += 64, dst += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst,        a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+    memcpy(dst, src, n);
+#elif defined(__aarch64__)
+    for (; n >= 64; n -= 64, src += 64, dst += 64)
+        __asm__ volatile("ldnp q0, q1, [%0]\n\t"
+                         "ldnp q2, q3, [%0, #32]\n\t"
+                         "stnp q0, q1, [%1]\n\t"
+                         "stnp q2, q3, [%1, #32]\n\t"
+                         :: "r"(src), "r"(dst) : "v0", "v1", "v2", "v3", "memory");
+    memcpy(dst, src, n);
+#else
+    memcpy(dst, src, n);
+#endif
+}
+
+static inline void av_frame_cow_fence(void)
+{
+#if defined(__SSE2__)
+    _mm_sfence();
+#elif defined(__aarch64__)
+    __asm__ volatile("dmb ishst" ::: "memory");
+#endif
+}
+
+/* Copy rows [task * h / nb_tasks, (task + 1) * h / nb_tasks) of every plane. */
+static inline void av_frame_cow_run_task(const AVFrameCOWJob *job, int task)
+{
+    int i, y;
+
+    for (i = 0; i < job->nb_planes; i++) {
+        int y0 = (int)((int64_t)job->height[i] *  task      / job->nb_tasks);
+        int y1 = (int)((int64_t)job->height[i] * (task + 1) / job->nb_tasks);
+        const uint8_t *src = job->src[i] + y0 * job->src_linesize[i];
+        uint8_t       *dst = job->dst[i] + y0 * job->dst_linesize[i];
+
+        if (job->nt) {
+            for (y = y0; y < y1; y++, src += job->src_linesize[i], dst += job->dst_linesize[i])
+                av_frame_cow_copy_line_nt(dst, src, job->bytewidth[i]);
+        } else if (job->src_linesize[i] == job->dst_linesize[i] &&
+                   job->src_linesize[i] == job->bytewidth[i]) {
+            memcpy(dst, src, (size_t)job->bytewidth[i] * (y1 - y0));
+        } else {
+            for (y = y0; y < y1; y++, src += job->src_linesize[i], dst += job->dst_linesize[i])
+                memcpy(dst, src, job->bytewidth[i]);
+        }
+    }
+    if (job->nt)
+        av_frame_cow_fence();
+}
+
+static inline void *av_frame_cow_worker(void *arg)
+{
+    AVFrameCOWWorker  *w   = (AVFrameCOWWorker *)arg;
+    AVFrameCOWContext *ctx = w->ctx;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (!ctx->quit && ctx->generation == seen)
+            pthread_cond_wait(&ctx->work_cond, &ctx->lock);
+        if (ctx->quit)
+            break;
+        seen = ctx->generation;
+        if (w->index >= ctx->job.nb_tasks)
+            continue;
+        pthread_mutex_unlock(&ctx->lock);
+
+        av_frame_cow_run_task(&ctx->job, w->index);
+
+        pthread_mutex_lock(&ctx->lock);
+        if (!--ctx->pending)
+            pthread_cond_signal(&ctx->done_cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/**
+ * Free the context and stop its threads.
+ */
+static inline void av_frame_cow_free(AVFrameCOWContext **pctx)
+{
+    AVFrameCOWContext *ctx = *pctx;
+    int i;
+
+    if (!ctx)
+        return;
+    if (ctx->nb_threads > 1) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->quit = 1;
+        pthread_cond_broadcast(&ctx->work_cond);
+        pthread_mutex_unlock(&ctx->lock);
+        /* worker 0 is the calling thread */
+        for (i = 1; i < ctx->nb_threads; i++)
+            pthread_join(ctx->workers[i].thread, NULL);
+        pthread_cond_destroy(&ctx->done_cond);
+        pthread_cond_destroy(&ctx->work_cond);
+        pthread_mutex_destroy(&ctx->lock);
+    }
+    av_freep(pctx);
+}
+
+/**
+ * Allocate a copy context.
+ *
+ * @param nb_threads       threads used for large copies, including the
+ *                         calling thread; 1 disables threading
+ * @param nt_threshold     frame size in bytes from which streaming stores
+ *                         are used, 0 for the default (4 MiB)
+ * @param thread_threshold frame size in bytes from which copies are
+ *                         threaded, 0 for the default (16 MiB)
+ * @return the context, or NULL on failure
+ */
+static inline AVFrameCOWContext *av_frame_cow_alloc(int nb_threads, size_t nt_threshold,
+                                                    size_t thread_threshold)
+{
+    AVFrameCOWContext *ctx = (AVFrameCOWContext *)av_mallocz(sizeof(*ctx));
+    int i;
+
+    if (!ctx)
+        return NULL;
+    ctx->nt_threshold     = nt_threshold     ? nt_threshold     : 4 << 20;
+    ctx->thread_threshold = thread_threshold ? thread_threshold : 16 << 20;
+    ctx->nb_threads       = av_clip(nb_threads, 1, AV_FRAME_COW_MAX_THREADS);
+    if (ctx->nb_threads == 1)
+        return ctx;
+
+    if (pthread_mutex_init(&ctx->lock, NULL)) {
+        av_free(ctx);
+        return NULL;
+    }
+    if (pthread_cond_init(&ctx->work_cond, NULL)) {
+        pthread_mutex_destroy(&ctx->lock);
+        av_free(ctx);
+        return NULL;
+    }
+    if (pthread_cond_init(&ctx->done_cond, NULL)) {
+        pthread_cond_destroy(&ctx->work_cond);
+        pthread_mutex_destroy(&ctx->lock);
+        av_free(ctx);
+        return NULL;
+    }
+    for (i = 1; i < ctx->nb_threads; i++) {
+        ctx->workers[i].ctx   = ctx;
+        ctx->workers[i].index = i;
+        if (pthread_create(&ctx->workers[i].thread, NULL, av_frame_cow_worker, &ctx->workers[i])) {
+            ctx->nb_threads = i;
+            av_frame_cow_free(&ctx);
+            return NULL;
+        }
+    }
+    return ctx;
+}
+
+/**
+ * Drop-in replacement for av_image_copy() that picks streaming stores and
+ * threading by frame size.
+ *
+ * @return 0 on success, a negative AVERROR for hardware formats
+ */
+static inline int av_frame_cow_image_copy(AVFrameCOWContext *ctx,
+                                          uint8_t *dst_data[4], const int dst_linesizes[4],
+                                          const uint8_t *src_data[4], const int src_linesizes[4],
+                                          enum AVPixelFormat pix_fmt, int width, int height)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    AVFrameCOWJob job;
+    size_t total = 0;
+    int i;
+
+    memset(&job, 0, sizeof(job));
+    if (!desc || desc->flags & AV_PIX_FMT_FLAG_HWACCEL)
+        return AVERROR(EINVAL);
+    if (desc->flags & AV_PIX_FMT_FLAG_PAL) {
+        /* one plane of indices plus a 1 KiB palette, nothing to gain */
+        av_image_copy(dst_data, (int *)dst_linesizes, src_data, src_linesizes,
+                      pix_fmt, width, height);
+        ctx->stats.copies++;
+        return 0;
+    }
+
+    for (i = 0; i < desc->nb_components; i++)
+        job.nb_planes = FFMAX(job.nb_planes, desc->comp[i].plane + 1);
+    for (i = 0; i < job.nb_planes; i++) {
+        int bwidth = av_image_get_linesize(pix_fmt, width, i);
+        if (bwidth < 0)
+            return bwidth;
+        job.dst[i]          = dst_data[i];
+        job.src[i]          = src_data[i];
+        job.dst_linesize[i] = dst_linesizes[i];
+        job.src_linesize[i] = src_linesizes[i];
+        job.bytewidth[i]    = bwidth;
+        job.height[i]       = i == 1 || i == 2 ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h)
+                                               : height;
+        total += (size_t)bwidth * job.height[i];
+    }
+
+    job.nt       = total >= ctx->nt_threshold;
+    job.nb_tasks = total >= ctx->thread_threshold ? ctx->nb_threads : 1;
+
+    ctx->stats.copies++;
+    ctx->stats.nt_copies    += job.nt;
+    ctx->stats.bytes_copied += total;
+
+    if (job.nb_tasks == 1) {
+        av_frame_cow_run_task(&job, 0);
+        return 0;
+    }
+
+    ctx->stats.threaded_copies++;
+    pthread_mutex_lock(&ctx->lock);
+    ctx->job     = job;
+    ctx->pending = job.nb_tasks - 1;
+    ctx->generation++;
+    pthread_cond_broadcast(&ctx->work_cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    av_frame_cow_run_task(&job, 0);
+
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->pending)
+        pthread_cond_wait(&ctx->done_cond, &ctx->lock);
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+/**
+ * Same as av_frame_copy(), using av_frame_cow_image_copy() for video.
+ * Audio and hardware frames go through av_frame_copy().
+ */
+static inline int av_frame_cow_copy(AVFrameCOWContext *ctx, AVFrame *dst, const AVFrame *src)
+{
+    if (dst->format != src->format || dst->format < 0)
+        return AVERROR(EINVAL);
+    if (!dst->width || src->hw_frames_ctx)
+        return av_frame_copy(dst, src);
+    if (dst->width < src->width || dst->height < src->height)
+        return AVERROR(EINVAL);
+
+    return av_frame_cow_image_copy(ctx, dst->data, dst->linesize,
+                                   (const uint8_t **)src->data, src->linesize,
+                                   (enum AVPixelFormat)dst->format, src->width, src->height);
+}
+
+/**
+ * Same as av_frame_make_writable(): returns at once when the frame owns its
+ * buffers, otherwise copies it into new buffers with av_frame_cow_copy().
+ *
+ * @return 0 on success, a negative AVERROR on failure
+ */
+static inline int av_frame_cow_make_writable(AVFrameCOWContext *ctx, AVFrame *frame)
+{
+    AVFrame *tmp;
+    int ret;
+
+    if (!frame->buf[0])
+        return AVERROR(EINVAL);
+    if (av_frame_is_writable(frame)) {
+        ctx->stats.writable_hits++;
+        return 0;
+    }
+    if (!frame->width || frame->hw_frames_ctx)
+        return av_frame_make_writable(frame);
+
+    tmp = av_frame_alloc();
+    if (!tmp)
+        return AVERROR(ENOMEM);
+    tmp->format = frame->format;
+    tmp->width  = frame->width;
+    tmp->height = frame->height;
+
+    ret = av_frame_get_buffer(tmp, 0);
+    if (ret < 0)
+        goto fail;
+    ret = av_frame_cow_copy(ctx, tmp, frame);
+    if (ret < 0)
+        goto fail;
+    ret = av_frame_copy_props(tmp, frame);
+    if (ret < 0)
+        goto fail;
+
+    av_frame_unref(frame);
+    av_frame_move_ref(frame, tmp);
+fail:
+    av_frame_free(&tmp);
+    return ret;
+}
+
+static inline void av_frame_cow_get_stats(const AVFrameCOWContext *ctx, AVFrameCOWStats *stats)
+{
+    *stats = ctx->stats;
+}
+
+/**
+ * @}
+ */
+
+#endif /* AVUTIL_FRAME_COW_H */
@@ -0,0 +1,117 @@
+/*
+ * Spin-then-block wait primitive for single-producer/single-consumer queues
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Wait primitive shared by AVAudioFifoSPSC and AVThreadMessageQueueSPSC.
+ *
+ * The side that has to wait spins for a bounded number of iterations, then
+ * registers itself and sleeps on a condition variable. The other side only
+ * touches the mutex when a waiter is registered. An uncontended handoff
+ * therefore costs one fence and one load, with no lock and no syscall.
+ */
+
+#ifndef AVUTIL_SPSC_WAIT_H
+#define AVUTIL_SPSC_WAIT_H
+
+#include <pthread.h>
+
+#include "cacheline.h"
+#include "error.h"
+
+#define AV_SPSC_CACHELINE AV_CACHELINE
+
+/** Default number of polls before a waiter goes to sleep. */
+#define AV_SPSC_DEFAULT_SPIN 4000
+
+#define av_spsc_load(p)      __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define av_spsc_store(p, v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static inline void av_spsc_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+typedef struct AVSPSCWait {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int waiting;
+    int spin;
+} AVSPSCWait;
+
+static inline int av_spsc_wait_init(AVSPSCWait *w, int spin)
+{
+    w->waiting = 0;
+    w->spin    = spin >= 0 ? spin : AV_SPSC_DEFAULT_SPIN;
+    if (pthread_mutex_init(&w->lock, NULL))
+        return AVERROR(ENOMEM);
+    if (pthread_cond_init(&w->cond, NULL)) {
+        pthread_mutex_destroy(&w->lock);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+static inline void av_spsc_wait_uninit(AVSPSCWait *w)
+{
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+}
+
+/**
+ * Wake the other side if it is sleeping. Call after publishing progress.
+ */
+static inline void av_spsc_wake(AVSPSCWait *w)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->waiting, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/**
+ * Wait until ready(opaque) returns non-zero: spin first, then sleep.
+ */
+static inline void av_spsc_wait(AVSPSCWait *w, int (*ready)(void *opaque), void *opaque)
+{
+    int i;
+
+    for (i = 0; i < w->spin; i++) {
+        if (ready(opaque))
+            return;
+        av_spsc_cpu_relax();
+    }
+
+    pthread_mutex_lock(&w->lock);
+    __atomic_store_n(&w->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (!ready(opaque))
+        pthread_cond_wait(&w->cond, &w->lock);
+    __atomic_store_n(&w->waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&w->lock);
+}
+
+#endif /* AVUTIL_SPSC_WAIT_H */
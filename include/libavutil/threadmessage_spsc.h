@@ -0,0 +1,251 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Lock-free single-producer/single-consumer variant of AVThreadMessageQueue.
+ *
+ * Same semantics as av_thread_message_queue_*(), restricted to one sending
+ * and one receiving thread. Send and receive are a ring slot copy plus one
+ * release store; the mutex is only taken when the other side is asleep.
+ */
+
+#ifndef AVUTIL_THREADMESSAGE_SPSC_H
+#define AVUTIL_THREADMESSAGE_SPSC_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "mem.h"
+#include "spsc_wait.h"
+#include "threadmessage.h"
+
+typedef struct AVThreadMessageQueueSPSC {
+    uint8_t *buf;
+    unsigned elsize;
+    unsigned nelem;
+    unsigned mask;
+    int err_send;
+    int err_recv;
+    void (*free_func)(void *msg);
+    AVSPSCWait data;    ///< receiver sleeps here
+    AVSPSCWait space;   ///< sender sleeps here
+
+    /* sender cache line */
+    unsigned write_pos   __attribute__((aligned(AV_SPSC_CACHELINE)));
+    unsigned cached_read;
+
+    /* receiver cache line */
+    unsigned read_pos    __attribute__((aligned(AV_SPSC_CACHELINE)));
+    unsigned cached_write;
+} AVThreadMessageQueueSPSC;
+
+/**
+ * Free a message queue. It must no longer be in use by either thread.
+ */
+static inline void av_thread_message_queue_spsc_free(AVThreadMessageQueueSPSC **mq)
+{
+    if (*mq) {
+        av_free((*mq)->buf);
+        av_spsc_wait_uninit(&(*mq)->data);
+        av_spsc_wait_uninit(&(*mq)->space);
+        free(*mq);
+        *mq = NULL;
+    }
+}
+
+/**
+ * Allocate a new SPSC message queue.
+ *
+ * @param mq      pointer to the message queue
+ * @param nelem   minimum number of elements in the queue, rounded up to a
+ *                power of two
+ * @param elsize  size of each element in the queue
+ * @param spin    polls before a waiting thread sleeps, <0 for the default,
+ *                0 to block immediately
+ * @return  >=0 for success; <0 for error
+ */
+static inline int av_thread_message_queue_spsc_alloc(AVThreadMessageQueueSPSC **mq,
+                                                     unsigned nelem,
+                                                     unsigned elsize,
+                                                     int spin)
+{
+    AVThreadMessageQueueSPSC *q;
+    void *mem;
+    unsigned n = 1;
+    int ret;
+
+    *mq = NULL;
+    if (!nelem || !elsize || nelem > INT_MAX / 2 || nelem > INT_MAX / elsize)
+        return AVERROR(EINVAL);
+    while (n < nelem)
+        n <<= 1;
+
+    if (posix_memalign(&mem, AV_SPSC_CACHELINE, sizeof(*q)))
+        return AVERROR(ENOMEM);
+    q = (AVThreadMessageQueueSPSC *)mem;
+    memset(q, 0, sizeof(*q));
+
+    if ((ret = av_spsc_wait_init(&q->data, spin)) < 0) {
+        free(q);
+        return ret;
+    }
+    if ((ret = av_spsc_wait_init(&q->space, spin)) < 0) {
+        av_spsc_wait_uninit(&q->data);
+        free(q);
+        return ret;
+    }
+    q->elsize = elsize;
+    q->nelem  = n;
+    q->mask   = n - 1;
+    q->buf    = (uint8_t *)av_malloc_array(n, elsize);
+    if (!q->buf) {
+        av_thread_message_queue_spsc_free(&q);
+        return AVERROR(ENOMEM);
+    }
+    *mq = q;
+    return 0;
+}
+
+/**
+ * Set the optional free message callback. Call before the queue is shared.
+ */
+static inline void av_thread_message_queue_spsc_set_free_func(AVThreadMessageQueueSPSC *mq,
+                                                              void (*free_func)(void *msg))
+{
+    mq->free_func = free_func;
+}
+
+/**
+ * Return the current number of messages in the queue.
+ */
+static inline int av_thread_message_queue_spsc_nb_elems(AVThreadMessageQueueSPSC *mq)
+{
+    return (int)(av_spsc_load(&mq->write_pos) - av_spsc_load(&mq->read_pos));
+}
+
+static inline int av_thread_message_queue_spsc_can_send(void *opaque)
+{
+    AVThreadMessageQueueSPSC *mq = (AVThreadMessageQueueSPSC *)opaque;
+
+    mq->cached_read = av_spsc_load(&mq->read_pos);
+    return mq->write_pos - mq->cached_read < mq->nelem ||
+           av_spsc_load(&mq->err_send);
+}
+
+static inline int av_thread_message_queue_spsc_can_recv(void *opaque)
+{
+    AVThreadMessageQueueSPSC *mq = (AVThreadMessageQueueSPSC *)opaque;
+
+    mq->cached_write = av_spsc_load(&mq->write_pos);
+    return mq->cached_write != mq->read_pos ||
+           av_spsc_load(&mq->err_recv);
+}
+
+/**
+ * Send a message on the queue. Sender thread only.
+ */
+static inline int av_thread_message_queue_spsc_send(AVThreadMessageQueueSPSC *mq,
+                                                    void *msg,
+                                                    unsigned flags)
+{
+    int err;
+
+    if ((err = av_spsc_load(&mq->err_send)))
+        return err;
+    if (mq->write_pos - mq->cached_read >= mq->nelem &&
+        !av_thread_message_queue_spsc_can_send(mq)) {
+        if (flags & AV_THREAD_MESSAGE_NONBLOCK)
+            return AVERROR(EAGAIN);
+        av_spsc_wait(&mq->space, av_thread_message_queue_spsc_can_send, mq);
+    }
+    if ((err = av_spsc_load(&mq->err_send)))
+        return err;
+
+    memcpy(mq->buf + (size_t)(mq->write_pos & mq->mask) * mq->elsize, msg, mq->elsize);
+    av_spsc_store(&mq->write_pos, mq->write_pos + 1);
+    av_spsc_wake(&mq->data);
+    return 0;
+}
+
+/**
+ * Receive a message from the queue. Receiver thread only.
+ */
+static inline int av_thread_message_queue_spsc_recv(AVThreadMessageQueueSPSC *mq,
+                                                    void *msg,
+                                                    unsigned flags)
+{
+    if (mq->cached_write == mq->read_pos &&
+        !av_thread_message_queue_spsc_can_recv(mq)) {
+        if (flags & AV_THREAD_MESSAGE_NONBLOCK)
+            return AVERROR(EAGAIN);
+        av_spsc_wait(&mq->data, av_thread_message_queue_spsc_can_recv, mq);
+    }
+    if (mq->cached_write == mq->read_pos) {
+        /* Re-check: a message may have been sent just before the error. */
+        mq->cached_write = av_spsc_load(&mq->write_pos);
+        if (mq->cached_write == mq->read_pos)
+            return av_spsc_load(&mq->err_recv);
+    }
+
+    memcpy(msg, mq->buf + (size_t)(mq->read_pos & mq->mask) * mq->elsize, mq->elsize);
+    av_spsc_store(&mq->read_pos, mq->read_pos + 1);
+    av_spsc_wake(&mq->space);
+    return 0;
+}
+
+/**
+ * Set the sending error code and wake a blocked sender.
+ */
+static inline void av_thread_message_queue_spsc_set_err_send(AVThreadMessageQueueSPSC *mq,
+                                                             int err)
+{
+    av_spsc_store(&mq->err_send, err);
+    av_spsc_wake(&mq->space);
+}
+
+/**
+ * Set the receiving error code and wake a blocked receiver.
+ */
+static inline void av_thread_message_queue_spsc_set_err_recv(AVThreadMessageQueueSPSC *mq,
+                                                             int err)
+{
+    av_spsc_store(&mq->err_recv, err);
+    av_spsc_wake(&mq->data);
+}
+
+/**
+ * Free every queued message. Receiver thread only.
+ */
+static inline void av_thread_message_queue_spsc_flush(AVThreadMessageQueueSPSC *mq)
+{
+    unsigned end = av_spsc_load(&mq->write_pos);
+    unsigned pos = mq->read_pos;
+
+    if (mq->free_func)
+        for (; pos != end; pos++)
+            mq->free_func(mq->buf + (size_t)(pos & mq->mask) * mq->elsize);
+    mq->cached_write = end;
+    av_spsc_store(&mq->read_pos, end);
+    av_spsc_wake(&mq->space);
+}
+
+#endif /* AVUTIL_THREADMESSAGE_SPSC_H */
@@ -0,0 +1,293 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Thread-safe cache of initialized AV_TX transform contexts.
+ */
+
+#ifndef AVUTIL_TX_CACHE_H
+#define AVUTIL_TX_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "error.h"
+#include "mem.h"
+#include "tx.h"
+
+/**
+ * av_tx_init() computes twiddle tables and permutation maps on every call,
+ * which can cost more than the transform itself for short lengths. An
+ * AVTXCache keeps initialized contexts keyed by (type, inv, len, scale,
+ * flags) and hands them out to any thread.
+ *
+ * A context has scratch buffers and must not run on two threads at once, so
+ * plans are checked out with av_tx_cache_get() and returned with
+ * av_tx_cache_put(). Each key keeps up to max_idle returned plans; a thread
+ * that finds none idle initializes a new one outside the lock.
+ *
+ * Create one cache per process and share it; the cache has no hidden global
+ * state.
+ */
+
+#define AV_TX_CACHE_BUCKETS 64
+
+typedef struct AVTXCacheKey {
+    enum AVTXType type;
+    int           inv;
+    int           len;
+    double        scale;
+    uint64_t      flags;
+} AVTXCacheKey;
+
+typedef struct AVTXCacheEntry AVTXCacheEntry;
+
+typedef struct AVTXPlan {
+    AVTXContext *ctx;
+    av_tx_fn     fn;
+
+    AVTXCacheEntry  *entry;
+    struct AVTXPlan *next;
+} AVTXPlan;
+
+struct AVTXCacheEntry {
+    AVTXCacheKey    key;
+    AVTXPlan       *idle;
+    int             nb_idle;
+    AVTXCacheEntry *next;
+};
+
+typedef struct AVTXCacheBucket {
+    pthread_mutex_t lock;
+    AVTXCacheEntry *entries;
+} AVTXCacheBucket;
+
+typedef struct AVTXCacheStats {
+    uint64_t hits;    ///< plans reused from the cache
+    uint64_t misses;  ///< plans created with av_tx_init()
+    int      keys;    ///< distinct configurations seen
+    int      idle;    ///< plans currently in the cache
+} AVTXCacheStats;
+
+typedef struct AVTXCache {
+    AVTXCacheBucket buckets[AV_TX_CACHE_BUCKETS];
+    int             max_idle;
+    uint64_t        hits;
+    uint64_t        misses;
+} AVTXCache;
+
+static inline int av_tx_cache_scale_is_double(enum AVTXType type)
+{
+    return type == AV_TX_DOUBLE_FFT || type == AV_TX_DOUBLE_MDCT;
+}
+
+static inline unsigned av_tx_cache_hash(const AVTXCacheKey *k)
+{
+    uint64_t s;
+    uint64_t h;
+
+    memcpy(&s, &k->scale, sizeof(s));
+    h = (uint64_t)k->type * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (uint64_t)k->inv)   * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (uint64_t)k->len)   * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ s)                  * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ k->flags)           * 0x9E3779B97F4A7C15ULL;
+    return (unsigned)(h >> 58) % AV_TX_CACHE_BUCKETS;
+}
+
+static inline int av_tx_cache_key_eq(const AVTXCacheKey *a, const AVTXCacheKey *b)
+{
+    return a->type  == b->type && a->inv   == b->inv && a->len == b->len &&
+           a->flags == b->flags && !memcmp(&a->scale, &b->scale, sizeof(a->scale));
+}
+
+/**
+ * Free the cache and every idle plan in it. All plans must have been
+ * returned.
+ */
+static inline void av_tx_cache_free(AVTXCache **pcache)
+{
+    AVTXCache *cache = *pcache;
+    int i;
+
+    if (!cache)
+        return;
+    for (i = 0; i < AV_TX_CACHE_BUCKETS; i++) {
+        AVTXCacheEntry *e = cache->buckets[i].entries;
+        while (e) {
+            AVTXCacheEntry *next_entry = e->next;
+            AVTXPlan *p = e->idle;
+            while (p) {
+                AVTXPlan *next = p->next;
+                av_tx_uninit(&p->ctx);
+                av_free(p);
+                p = next;
+            }
+            av_free(e);
+            e = next_entry;
+        }
+        pthread_mutex_destroy(&cache->buckets[i].lock);
+    }
+    av_freep(pcache);
+}
+
+/**
+ * Allocate a cache.
+ *
+ * @param max_idle plans kept per configuration, 0 for the default (16)
+ * @return the cache, or NULL on failure
+ */
+static inline AVTXCache *av_tx_cache_alloc(int max_idle)
+{
+    AVTXCache *cache = (AVTXCache *)av_mallocz(sizeof(*cache));
+    int i;
+
+    if (!cache)
+        return NULL;
+    cache->max_idle = max_idle > 0 ? max_idle : 16;
+    for (i = 0; i < AV_TX_CACHE_BUCKETS; i++) {
+        if (pthread_mutex_init(&cache->buckets[i].lock, NULL)) {
+            while (i--)
+                pthread_mutex_destroy(&cache->buckets[i].lock);
+            av_free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+/**
+ * Check out a plan, taking it from the cache or creating it.
+ * Arguments are the same as for av_tx_init().
+ *
+ * @param plan set to the plan on success, NULL on failure; run it with
+ *             (*plan)->fn((*plan)->ctx, out, in, stride)
+ * @return 0 on success, a negative AVERROR on failure
+ */
+static inline int av_tx_cache_get(AVTXCache *cache, AVTXPlan **plan, enum AVTXType type,
+                                  int inv, int len, const void *scale, uint64_t flags)
+{
+    AVTXCacheBucket *b;
+    AVTXCacheEntry *e;
+    AVTXCacheKey key;
+    AVTXPlan *p;
+    int ret;
+
+    *plan = NULL;
+    memset(&key, 0, sizeof(key));
+    key.type  = type;
+    key.inv   = !!inv;
+    key.len   = len;
+    key.flags = flags;
+    if (scale)
+        key.scale = av_tx_cache_scale_is_double(type) ? *(const double *)scale
+                                                      : *(const float *)scale;
+    b = &cache->buckets[av_tx_cache_hash(&key)];
+
+    pthread_mutex_lock(&b->lock);
+    for (e = b->entries; e; e = e->next)
+        if (av_tx_cache_key_eq(&e->key, &key))
+            break;
+    if (!e) {
+        e = (AVTXCacheEntry *)av_mallocz(sizeof(*e));
+        if (!e) {
+            pthread_mutex_unlock(&b->lock);
+            return AVERROR(ENOMEM);
+        }
+        e->key     = key;
+        e->next    = b->entries;
+        b->entries = e;
+    }
+    if ((p = e->idle)) {
+        e->idle = p->next;
+        e->nb_idle--;
+        __atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&b->lock);
+        p->next = NULL;
+        *plan   = p;
+        return 0;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    p = (AVTXPlan *)av_mallocz(sizeof(*p));
+    if (!p)
+        return AVERROR(ENOMEM);
+    ret = av_tx_init(&p->ctx, &p->fn, type, inv, len, scale, flags);
+    if (ret < 0) {
+        av_free(p);
+        return ret;
+    }
+    p->entry = e;
+    __atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+    *plan = p;
+    return 0;
+}
+
+/**
+ * Return a plan to the cache and set *plan to NULL.
+ */
+static inline void av_tx_cache_put(AVTXCache *cache, AVTXPlan **plan)
+{
+    AVTXPlan *p = *plan;
+    AVTXCacheBucket *b;
+    AVTXCacheEntry *e;
+
+    if (!p)
+        return;
+    *plan = NULL;
+    e = p->entry;
+    b = &cache->buckets[av_tx_cache_hash(&e->key)];
+
+    pthread_mutex_lock(&b->lock);
+    if (e->nb_idle < cache->max_idle) {
+        p->next = e->idle;
+        e->idle = p;
+        e->nb_idle++;
+        p = NULL;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    if (p) {
+        av_tx_uninit(&p->ctx);
+        av_free(p);
+    }
+}
+
+static inline void av_tx_cache_get_stats(AVTXCache *cache, AVTXCacheStats *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->hits   = __atomic_load_n(&cache->hits,   __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+    for (i = 0; i < AV_TX_CACHE_BUCKETS; i++) {
+        AVTXCacheBucket *b = &cache->buckets[i];
+        AVTXCacheEntry *e;
+
+        pthread_mutex_lock(&b->lock);
+        for (e = b->entries; e; e = e->next) {
+            stats->keys++;
+            stats->idle += e->nb_idle;
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+#endif /* AVUTIL_TX_CACHE_H */
@@ -0,0 +1,314 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef POSTPROC_POSTPROCESS_SLICE_H
+#define POSTPROC_POSTPROCESS_SLICE_H
+
+/**
+ * @file
+ * @ingroup lpp
+ * Slice-threaded front-end for pp_postprocess().
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libpostproc/postprocess.h"
+
+/**
+ * @addtogroup lpp
+ * @{
+ *
+ * pp_postprocess() filters a whole frame on the calling thread. A
+ * pp_slice_context splits the frame into horizontal bands, one per thread,
+ * each with its own pp_context since a context holds per-frame scratch
+ * memory and cannot be shared.
+ *
+ * Each band is filtered together with PP_SLICE_OVERLAP rows of its
+ * neighbours into a private buffer, and only its own rows are copied to
+ * the destination. Bands start on macroblock rows, so the block grid, the
+ * QP lookup and the temporal noise reducer history stay the same as for a
+ * whole frame.
+ *
+ * The output is not bit-exact with pp_postprocess(), only within tolerance.
+ * The first row of a band's private buffer is a picture edge to libpostproc,
+ * so that edge is not deblocked and the deringing below it sees different
+ * input. Deblocking and deringing run block row by block row, each on the
+ * output of the previous one, so the difference can carry on from one
+ * block row to the next and into the band's own rows; the overlap lets it
+ * die down but no finite overlap rules it out. Autolevels ("al") differ
+ * more, as its histogram becomes per band.
+ */
+
+/**
+ * Rows of context above and below each band. Covers the vertical support
+ * of the deblocking, deringing and deinterlacing filters within one pass;
+ * see above for the differences that can still reach the band's own rows.
+ */
+#define PP_SLICE_OVERLAP 16
+
+#define PP_SLICE_MAX_THREADS 32
+
+typedef struct pp_slice_context pp_slice_context;
+
+typedef struct pp_slice_band {
+    pp_slice_context *s;
+    pp_context       *pp;
+    pthread_t         thread;
+    int               index;
+    int               y0, y1;     ///< luma rows owned by the band
+    int               ys, ye;     ///< luma rows filtered, including overlap
+    uint8_t          *buf[3];
+    int               stride[3];
+} pp_slice_band;
+
+typedef struct pp_slice_job {
+    const uint8_t *src[3];
+    int            src_stride[3];
+    uint8_t       *dst[3];
+    int            dst_stride[3];
+    const int8_t  *qp;
+    int            qp_stride;
+    pp_mode       *mode;
+    int            pict_type;
+} pp_slice_job;
+
+struct pp_slice_context {
+    int width, height;
+    int hshift, vshift;
+    int nb_bands;
+    pp_slice_band band[PP_SLICE_MAX_THREADS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t  work_cond;
+    pthread_cond_t  done_cond;
+    pp_slice_job    job;
+    unsigned        generation;
+    int             pending;
+    int             quit;
+    int             threads_started;
+};
+
+static inline int pp_slice_min(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+static inline void pp_slice_run_band(pp_slice_context *s, pp_slice_band *b)
+{
+    const pp_slice_job *job = &s->job;
+    const uint8_t *src[3];
+    uint8_t *dst[3];
+    int i, y;
+
+    for (i = 0; i < 3; i++) {
+        int ys = i ? b->ys >> s->vshift : b->ys;
+        src[i] = job->src[i] + (ptrdiff_t)ys * job->src_stride[i];
+        dst[i] = b->buf[i];
+    }
+    pp_postprocess(src, job->src_stride, dst, b->stride,
+                   s->width, b->ye - b->ys,
+                   job->qp && job->qp_stride ? job->qp + (b->ys >> 4) * job->qp_stride : job->qp,
+                   job->qp_stride, job->mode, b->pp, job->pict_type);
+
+    for (i = 0; i < 3; i++) {
+        int w  = i ? -((-s->width) >> s->hshift) : s->width;
+        int y0 = i ? b->y0 >> s->vshift : b->y0;
+        int y1 = i ? -((-b->y1) >> s->vshift) : b->y1;
+        int ys = i ? b->ys >> s->vshift : b->ys;
+        for (y = y0; y < y1; y++)
+            memcpy(job->dst[i] + (ptrdiff_t)y * job->dst_stride[i],
+                   b->buf[i] + (ptrdiff_t)(y - ys) * b->stride[i], w);
+    }
+}
+
+static inline void *pp_slice_worker(void *arg)
+{
+    pp_slice_band    *b = (pp_slice_band *)arg;
+    pp_slice_context *s = b->s;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->quit && s->generation == seen)
+            pthread_cond_wait(&s->work_cond, &s->lock);
+        if (s->quit)
+            break;
+        seen = s->generation;
+        pthread_mutex_unlock(&s->lock);
+
+        pp_slice_run_band(s, b);
+
+        pthread_mutex_lock(&s->lock);
+        if (!--s->pending)
+            pthread_cond_signal(&s->done_cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static inline void pp_slice_free_context(pp_slice_context *s)
+{
+    int i;
+
+    if (!s)
+        return;
+    if (s->threads_started) {
+        pthread_mutex_lock(&s->lock);
+        s->quit = 1;
+        pthread_cond_broadcast(&s->work_cond);
+        pthread_mutex_unlock(&s->lock);
+        /* band 0 runs on the calling thread */
+        for (i = 1; i < s->threads_started; i++)
+            pthread_join(s->band[i].thread, NULL);
+    }
+    for (i = 0; i < s->nb_bands; i++) {
+        if (s->band[i].pp)
+            pp_free_context(s->band[i].pp);
+        free(s->band[i].buf[0]);
+    }
+    pthread_cond_destroy(&s->done_cond);
+    pthread_cond_destroy(&s->work_cond);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+/**
+ * Same as pp_get_context(), filtering with up to nb_threads threads.
+ *
+ * @param flags PP_FORMAT_* and PP_CPU_CAPS_* flags, as for pp_get_context()
+ * @return the context, or NULL on failure
+ */
+static inline pp_slice_context *pp_slice_get_context(int width, int height, int flags,
+                                                     int nb_threads)
+{
+    pp_slice_context *s = (pp_slice_context *)calloc(1, sizeof(*s));
+    int i, band_h, max_rows;
+
+    if (!s)
+        return NULL;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work_cond, NULL);
+    pthread_cond_init(&s->done_cond, NULL);
+    s->width  = width;
+    s->height = height;
+    /* same decoding of the format flags as pp_get_context() */
+    s->hshift = flags & PP_FORMAT ? flags & 0x3        : 1;
+    s->vshift = flags & PP_FORMAT ? (flags >> 4) & 0x3 : 1;
+
+    if (nb_threads < 1)
+        nb_threads = 1;
+    if (nb_threads > PP_SLICE_MAX_THREADS)
+        nb_threads = PP_SLICE_MAX_THREADS;
+    /* bands narrower than their overlap are not worth it */
+    while (nb_threads > 1 && height / nb_threads < 4 * PP_SLICE_OVERLAP)
+        nb_threads--;
+
+    band_h   = ((height + nb_threads - 1) / nb_threads + 15) & ~15;
+    max_rows = nb_threads > 1 ? band_h + 2 * PP_SLICE_OVERLAP : height;
+    for (i = 0; i < nb_threads; i++) {
+        pp_slice_band *b = &s->band[i];
+        int cw = -((-width) >> s->hshift);
+        int ch = -((-max_rows) >> s->vshift);
+        int p;
+
+        b->s     = s;
+        b->index = i;
+        b->y0    = i * band_h;
+        b->y1    = pp_slice_min(height, b->y0 + band_h);
+        if (b->y0 >= b->y1)
+            break;
+        s->nb_bands++;
+        b->ys    = b->y0 > PP_SLICE_OVERLAP ? b->y0 - PP_SLICE_OVERLAP : 0;
+        b->ye    = pp_slice_min(height, b->y1 + PP_SLICE_OVERLAP);
+
+        b->pp = pp_get_context(width, max_rows, flags);
+        if (!b->pp)
+            goto fail;
+        b->stride[0] = (width + 31) & ~31;
+        b->stride[1] = b->stride[2] = (cw + 31) & ~31;
+        b->buf[0] = (uint8_t *)malloc((size_t)b->stride[0] * max_rows +
+                                      (size_t)b->stride[1] * ch * 2);
+        if (!b->buf[0])
+            goto fail;
+        for (p = 1; p < 3; p++)
+            b->buf[p] = b->buf[p - 1] + (size_t)b->stride[p - 1] * (p == 1 ? max_rows : ch);
+    }
+
+    for (i = 1; i < s->nb_bands; i++) {
+        if (pthread_create(&s->band[i].thread, NULL, pp_slice_worker, &s->band[i]))
+            goto fail;
+        s->threads_started = i + 1;
+    }
+    return s;
+
+fail:
+    pp_slice_free_context(s);
+    return NULL;
+}
+
+/**
+ * Same as pp_postprocess(), with the frame split across the context's
+ * threads. width and height must be those given to pp_slice_get_context().
+ */
+static inline void pp_slice_postprocess(pp_slice_context *s,
+                                        const uint8_t *src[3], const int srcStride[3],
+                                        uint8_t *dst[3], const int dstStride[3],
+                                        const int8_t *QP_store, int QP_stride,
+                                        pp_mode *mode, int pict_type)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        s->job.src[i]        = src[i];
+        s->job.src_stride[i] = srcStride[i];
+        s->job.dst[i]        = dst[i];
+        s->job.dst_stride[i] = dstStride[i];
+    }
+    s->job.qp        = QP_store;
+    s->job.qp_stride = QP_stride;
+    s->job.mode      = mode;
+    s->job.pict_type = pict_type;
+
+    if (s->nb_bands == 1) {
+        pp_postprocess(src, srcStride, dst, dstStride, s->width, s->height,
+                       QP_store, QP_stride, mode, s->band[0].pp, pict_type);
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->pending = s->nb_bands - 1;
+    s->generation++;
+    pthread_cond_broadcast(&s->work_cond);
+    pthread_mutex_unlock(&s->lock);
+
+    pp_slice_run_band(s, &s->band[0]);
+
+    pthread_mutex_lock(&s->lock);
+    while (s->pending)
+        pthread_cond_wait(&s->done_cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * @}
+ */
+
+#endif /* POSTPROC_POSTPROCESS_SLICE_H */
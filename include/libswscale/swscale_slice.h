@@ -0,0 +1,442 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SWSCALE_SWSCALE_SLICE_H
+#define SWSCALE_SWSCALE_SLICE_H
+
+/**
+ * @file
+ * @ingroup libsws
+ * Slice-threaded conversion fed by decoder slice output.
+ *
+ * The decoder reports finished source rows through
+ * sws_slice_pipeline_send_slice(), typically from
+ * AVCodecContext.draw_horiz_band. sws_slice_pipeline_wait() returns once
+ * the whole output is written.
+ *
+ * There are two modes, picked at allocation:
+ *
+ * - band mode, used when source and destination have the same height and
+ *   the same vertical chroma subsampling. The output picture is split into
+ *   horizontal bands, one SwsContext and one worker thread per band. No
+ *   output row then depends on source rows outside its band, so each band
+ *   is converted with sws_scale() on band-local pointers as soon as its own
+ *   source rows are complete, and conversion runs while the decoder is
+ *   still producing the rows below.
+ *   Bands are aligned to 16 rows, so chroma planes and the 8-row ordered
+ *   dither pattern keep their phase.
+ *
+ * - frame mode, used for everything else. An output band depends on source
+ *   rows across band borders, and sws_receive_slice() in this libswscale
+ *   only produces output once the whole input frame has been sent, so
+ *   nothing can start early. A single worker converts the frame with
+ *   sws_scale_frame() after the last source slice arrives, on a context
+ *   whose "threads" option is set to nb_threads: libswscale then splits
+ *   the output into slices on its own thread pool, which scales better
+ *   than one full-frame context per band. Any overlap with decoding then
+ *   comes from decoding the next frame into a different buffer.
+ *
+ * The statistics report the tail latency, measured from the last source
+ * slice to a complete output, which is the part the decoder cannot hide.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libavutil/error.h"
+#include "libavutil/frame.h"
+#include "libavutil/mem.h"
+#include "libavutil/opt.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/time.h"
+#include "swscale.h"
+
+#define SWS_SLICE_BAND_ALIGN 16
+
+typedef struct SwsSliceStats {
+    uint64_t frames;
+    int      band_mode;         ///< 1 if bands run while rows still arrive
+    int64_t  last_tail_us;      ///< last frame: last input slice -> output done
+    int64_t  total_tail_us;
+    int64_t  total_frame_us;    ///< sum of start -> output done
+} SwsSliceStats;
+
+typedef struct SwsSlicePipeline SwsSlicePipeline;
+
+typedef struct SwsSliceWorker {
+    SwsSlicePipeline *p;
+    struct SwsContext *ctx;
+    pthread_t thread;
+    int thread_started;
+    int index;
+    int dst_start, dst_end;     ///< output rows of this band
+    int missing;                ///< band mode: source rows still outstanding
+    unsigned seq;               ///< last frame this worker finished
+} SwsSliceWorker;
+
+struct SwsSlicePipeline {
+    SwsSliceWorker *workers;
+    int nb_workers;
+    int band_mode;
+    int srcH;
+    const AVPixFmtDescriptor *src_desc, *dst_desc;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  work_cond;  ///< workers: new frame or new rows
+    pthread_cond_t  done_cond;  ///< caller: a band finished
+
+    const AVFrame *src;
+    AVFrame *dst;
+    uint8_t *row_ready;
+    int rows_ready;
+    unsigned seq;               ///< current frame, 0 = none yet
+    int bands_left;
+    int err;
+    int quit;
+
+    int64_t t_start, t_input;
+    SwsSliceStats stats;
+};
+
+static inline void sws_slice_band_ptrs(const AVPixFmtDescriptor *desc,
+                                       uint8_t *const data[4], const int linesize[4],
+                                       int y, uint8_t *out[4])
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        int shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+
+        if (!data[i] || ((desc->flags & AV_PIX_FMT_FLAG_PAL) && i == 1))
+            out[i] = data[i];
+        else
+            out[i] = data[i] + (ptrdiff_t)(y >> shift) * linesize[i];
+    }
+}
+
+static inline int sws_slice_run_band(SwsSliceWorker *w)
+{
+    SwsSlicePipeline *p = w->p;
+    int h = w->dst_end - w->dst_start;
+    int ret;
+
+    if (p->band_mode) {
+        uint8_t *src[4], *dst[4];
+
+        sws_slice_band_ptrs(p->src_desc, p->src->data, p->src->linesize, w->dst_start, src);
+        sws_slice_band_ptrs(p->dst_desc, p->dst->data, p->dst->linesize, w->dst_start, dst);
+        ret = sws_scale(w->ctx, (const uint8_t *const *)src, p->src->linesize, 0, h,
+                        dst, p->dst->linesize);
+        return ret < 0 ? ret : 0;
+    }
+
+    ret = sws_scale_frame(w->ctx, p->dst, p->src);
+    return ret < 0 ? ret : 0;
+}
+
+static inline void *sws_slice_worker(void *arg)
+{
+    SwsSliceWorker *w   = (SwsSliceWorker *)arg;
+    SwsSlicePipeline *p = w->p;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        int ret;
+
+        while (!p->quit &&
+               (w->seq == p->seq ||
+                (p->band_mode ? w->missing > 0 : p->rows_ready < p->srcH)))
+            pthread_cond_wait(&p->work_cond, &p->lock);
+        if (p->quit)
+            break;
+        pthread_mutex_unlock(&p->lock);
+
+        ret = sws_slice_run_band(w);
+
+        pthread_mutex_lock(&p->lock);
+        w->seq = p->seq;
+        if (ret < 0 && !p->err)
+            p->err = ret;
+        if (!--p->bands_left)
+            pthread_cond_broadcast(&p->done_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/**
+ * Free the pipeline and all its contexts. Must not be called while a frame
+ * is in flight.
+ */
+static inline void sws_slice_pipeline_free(SwsSlicePipeline **pp)
+{
+    SwsSlicePipeline *p = *pp;
+    int i;
+
+    if (!p)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 0; i < p->nb_workers; i++) {
+        if (p->workers[i].thread_started)
+            pthread_join(p->workers[i].thread, NULL);
+        sws_freeContext(p->workers[i].ctx);
+    }
+    pthread_cond_destroy(&p->done_cond);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_mutex_destroy(&p->lock);
+    av_freep(&p->workers);
+    av_freep(&p->row_ready);
+    av_freep(pp);
+}
+
+/**
+ * Full-frame context converting with nb_threads libswscale slice threads.
+ */
+static inline struct SwsContext *sws_slice_frame_context(int srcW, int srcH,
+                                                         enum AVPixelFormat srcFormat,
+                                                         int dstW, int dstH,
+                                                         enum AVPixelFormat dstFormat,
+                                                         int flags, int nb_threads)
+{
+    struct SwsContext *ctx = sws_alloc_context();
+
+    if (!ctx)
+        return NULL;
+    if (av_opt_set_int(ctx, "srcw",       srcW,       0) < 0 ||
+        av_opt_set_int(ctx, "srch",       srcH,       0) < 0 ||
+        av_opt_set_int(ctx, "src_format", srcFormat,  0) < 0 ||
+        av_opt_set_int(ctx, "dstw",       dstW,       0) < 0 ||
+        av_opt_set_int(ctx, "dsth",       dstH,       0) < 0 ||
+        av_opt_set_int(ctx, "dst_format", dstFormat,  0) < 0 ||
+        av_opt_set_int(ctx, "sws_flags",  flags,      0) < 0 ||
+        av_opt_set_int(ctx, "threads",    nb_threads, 0) < 0 ||
+        sws_init_context(ctx, NULL, NULL) < 0) {
+        sws_freeContext(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/**
+ * Allocate a slice pipeline.
+ *
+ * @param nb_threads number of threads, at least 1: one band and worker
+ *                   thread each in band mode, libswscale slice threads
+ *                   in frame mode
+ * @param flags      SWS_* flags as for sws_getContext()
+ * @return 0 on success, a negative AVERROR code on failure
+ */
+static inline int sws_slice_pipeline_alloc(SwsSlicePipeline **pp,
+                                           int srcW, int srcH, enum AVPixelFormat srcFormat,
+                                           int dstW, int dstH, enum AVPixelFormat dstFormat,
+                                           int flags, int nb_threads)
+{
+    SwsSlicePipeline *p;
+    int i, ret, band, nb_bands;
+
+    *pp = NULL;
+    if (srcW <= 0 || srcH <= 0 || dstW <= 0 || dstH <= 0 || nb_threads < 1)
+        return AVERROR(EINVAL);
+
+    p = (SwsSlicePipeline *)av_mallocz(sizeof(*p));
+    if (!p)
+        return AVERROR(ENOMEM);
+    p->src_desc = av_pix_fmt_desc_get(srcFormat);
+    p->dst_desc = av_pix_fmt_desc_get(dstFormat);
+    if (!p->src_desc || !p->dst_desc ||
+        (p->src_desc->flags & AV_PIX_FMT_FLAG_HWACCEL) ||
+        (p->dst_desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+        av_free(p);
+        return AVERROR(EINVAL);
+    }
+    p->srcH      = srcH;
+    p->band_mode = srcH == dstH &&
+                   p->src_desc->log2_chroma_h == p->dst_desc->log2_chroma_h;
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+
+    /* frame mode: one worker, the threads are inside libswscale */
+    nb_bands = p->band_mode ? nb_threads : 1;
+    p->row_ready = (uint8_t *)av_mallocz(srcH);
+    p->workers   = (SwsSliceWorker *)av_calloc(nb_bands, sizeof(*p->workers));
+    if (!p->row_ready || !p->workers) {
+        sws_slice_pipeline_free(&p);
+        return AVERROR(ENOMEM);
+    }
+
+    band = (dstH + nb_bands - 1) / nb_bands;
+    band = (band + SWS_SLICE_BAND_ALIGN - 1) / SWS_SLICE_BAND_ALIGN * SWS_SLICE_BAND_ALIGN;
+
+    for (i = 0; i < nb_bands; i++) {
+        SwsSliceWorker *w = &p->workers[i];
+
+        w->p         = p;
+        w->index     = i;
+        w->dst_start = FFMIN(i * band, dstH);
+        w->dst_end   = FFMIN(w->dst_start + band, dstH);
+        p->nb_workers++;
+        if (w->dst_start == w->dst_end)
+            continue;               /* more threads than bands */
+        if (p->band_mode)
+            w->ctx = sws_getContext(srcW, w->dst_end - w->dst_start, srcFormat,
+                                    dstW, w->dst_end - w->dst_start, dstFormat,
+                                    flags, NULL, NULL, NULL);
+        else
+            w->ctx = sws_slice_frame_context(srcW, srcH, srcFormat, dstW, dstH, dstFormat,
+                                             flags, nb_threads);
+        if (!w->ctx) {
+            sws_slice_pipeline_free(&p);
+            return AVERROR(EINVAL);
+        }
+        if ((ret = pthread_create(&w->thread, NULL, sws_slice_worker, w))) {
+            sws_slice_pipeline_free(&p);
+            return AVERROR(ret);
+        }
+        w->thread_started = 1;
+    }
+    p->stats.band_mode = p->band_mode;
+    *pp = p;
+    return 0;
+}
+
+/**
+ * Begin converting a new frame. src and dst must stay valid until
+ * sws_slice_pipeline_wait() returns; dst buffers must already be
+ * allocated, and in frame mode both frames must be reference counted.
+ * The source rows need not be decoded yet.
+ */
+static inline int sws_slice_pipeline_start(SwsSlicePipeline *p, AVFrame *dst,
+                                           const AVFrame *src)
+{
+    int i;
+
+    if (!dst->data[0] || !src->data[0])
+        return AVERROR(EINVAL);
+
+    pthread_mutex_lock(&p->lock);
+    if (p->bands_left) {
+        pthread_mutex_unlock(&p->lock);
+        return AVERROR(EBUSY);
+    }
+    p->src        = src;
+    p->dst        = dst;
+    p->rows_ready = 0;
+    p->err        = 0;
+    memset(p->row_ready, 0, p->srcH);
+    for (i = 0; i < p->nb_workers; i++) {
+        SwsSliceWorker *w = &p->workers[i];
+
+        w->missing = w->dst_end - w->dst_start;
+        if (w->ctx)
+            p->bands_left++;
+    }
+    p->t_start = av_gettime_relative();
+    p->seq++;
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+/**
+ * Signal that source rows [y, y + height) of the current frame are
+ * decoded. Slices may come in any order and may be repeated. Safe to call
+ * from the decoder's draw_horiz_band callback.
+ */
+static inline int sws_slice_pipeline_send_slice(SwsSlicePipeline *p, int y, int height)
+{
+    int i, row, wake = 0;
+
+    if (y < 0 || height < 0 || y + height > p->srcH)
+        return AVERROR(EINVAL);
+
+    pthread_mutex_lock(&p->lock);
+    for (row = y; row < y + height; row++) {
+        if (p->row_ready[row])
+            continue;
+        p->row_ready[row] = 1;
+        p->rows_ready++;
+        if (p->band_mode)
+            for (i = 0; i < p->nb_workers; i++) {
+                SwsSliceWorker *w = &p->workers[i];
+                if (row >= w->dst_start && row < w->dst_end && !--w->missing)
+                    wake = 1;
+            }
+    }
+    if (p->rows_ready == p->srcH) {
+        p->t_input = av_gettime_relative();
+        wake = 1;
+    }
+    if (wake)
+        pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+/**
+ * Wait until the current frame is fully converted.
+ *
+ * @return 0 on success, the first band error otherwise
+ */
+static inline int sws_slice_pipeline_wait(SwsSlicePipeline *p)
+{
+    int64_t now;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->bands_left)
+        pthread_cond_wait(&p->done_cond, &p->lock);
+    now = av_gettime_relative();
+    if (p->rows_ready == p->srcH) {
+        p->stats.frames++;
+        p->stats.last_tail_us    = now - p->t_input;
+        p->stats.total_tail_us  += p->stats.last_tail_us;
+        p->stats.total_frame_us += now - p->t_start;
+    }
+    ret = p->err;
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+/**
+ * Convert a whole, already decoded frame: start + one full slice + wait.
+ */
+static inline int sws_slice_pipeline_scale_frame(SwsSlicePipeline *p, AVFrame *dst,
+                                                 const AVFrame *src)
+{
+    int ret = sws_slice_pipeline_start(p, dst, src);
+
+    if (ret < 0)
+        return ret;
+    sws_slice_pipeline_send_slice(p, 0, p->srcH);
+    return sws_slice_pipeline_wait(p);
+}
+
+static inline void sws_slice_pipeline_get_stats(SwsSlicePipeline *p, SwsSliceStats *stats)
+{
+    pthread_mutex_lock(&p->lock);
+    *stats = p->stats;
+    pthread_mutex_unlock(&p->lock);
+}
+
+#endif /* SWSCALE_SWSCALE_SLICE_H */
@@ -0,0 +1,575 @@
+/*
+ * Pipelined asynchronous transfers on top of the libusb asyncio API
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef USB_PIPELINE_H
+#define USB_PIPELINE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "libusb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \defgroup usb_pipeline Pipelined transfers
+ * A usb_pipeline keeps several transfers in flight per endpoint instead of
+ * submitting one transfer and waiting for it. It owns a dedicated event
+ * thread for its libusb_context, driven by
+ * libusb_handle_events_timeout_completed(). Completed transfers are handed
+ * to the application in batches, one callback per event loop iteration.
+ * That lets a redirection layer pack several completions into a single
+ * channel PDU.
+ *
+ * Each endpoint has a fixed ring of \p depth transfers allocated up front.
+ * Completions on one endpoint are delivered in submission order. The
+ * sequence number in \ref usb_pipeline_completion lets callers check that.
+ *
+ * Two submission modes are available:
+ * - request driven: usb_pipeline_submit(), or usb_pipeline_acquire() and
+ *   usb_pipeline_commit() to fill the transfer buffer in place;
+ * - streaming (IN endpoints): usb_pipeline_stream() submits every free
+ *   transfer and resubmits each one as soon as its completion has been
+ *   delivered, which keeps isochronous webcams and bulk readers saturated.
+ *
+ * The pipeline must be the only event handler of its context.
+ */
+
+struct usb_pipeline;
+struct usb_pipeline_endpoint;
+struct usb_pipeline_slot;
+
+/** \ingroup usb_pipeline
+ * One completed transfer, valid only for the duration of the batch callback.
+ * \ref transfer gives access to status, actual_length, buffer and, for
+ * isochronous endpoints, the per-packet descriptors.
+ */
+struct usb_pipeline_completion {
+	struct usb_pipeline_endpoint *endpoint;
+	struct libusb_transfer *transfer;
+	void *user_data;
+	uint64_t sequence;
+};
+
+/** \ingroup usb_pipeline
+ * Batch completion callback, invoked on the event thread.
+ * Must not block on the pipeline (acquire with wait, free).
+ */
+typedef void (*usb_pipeline_batch_cb)(void *user_data,
+	const struct usb_pipeline_completion *completions, int count);
+
+/** \ingroup usb_pipeline
+ * Per-endpoint counters, see usb_pipeline_get_stats().
+ */
+struct usb_pipeline_stats {
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t errors;
+	uint64_t bytes;
+	int in_flight;
+	int peak_in_flight;
+};
+
+struct usb_pipeline_slot {
+	struct libusb_transfer *transfer;
+	struct usb_pipeline_endpoint *endpoint;
+	struct usb_pipeline_slot *next_free;
+	void *user_data;
+	uint64_t sequence;
+};
+
+struct usb_pipeline_endpoint {
+	struct usb_pipeline *pipeline;
+	struct usb_pipeline_endpoint *next;
+	libusb_device_handle *dev_handle;
+	unsigned char address;
+	unsigned char type;
+	int depth;
+	int buffer_length;
+	int num_iso_packets;
+	unsigned int timeout;
+	int streaming;
+	uint64_t next_sequence;
+	struct usb_pipeline_slot *slots;
+	struct usb_pipeline_slot *free_list;
+	struct usb_pipeline_stats stats;
+};
+
+struct usb_pipeline {
+	libusb_context *ctx;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+	int in_flight;
+	usb_pipeline_batch_cb callback;
+	void *callback_data;
+	int max_batch;
+	int batch_count;
+	uint64_t batches;
+	struct usb_pipeline_completion *batch;
+	struct usb_pipeline_slot **batch_slots;
+	struct usb_pipeline_endpoint *endpoints;
+};
+
+/* Called with the pipeline lock held. */
+static inline int usb_pipeline_submit_locked(struct usb_pipeline_slot *slot)
+{
+	struct usb_pipeline_endpoint *ep = slot->endpoint;
+	int r;
+
+	slot->sequence = ep->next_sequence;
+	r = libusb_submit_transfer(slot->transfer);
+	if (r != LIBUSB_SUCCESS)
+		return r;
+
+	ep->next_sequence++;
+	ep->stats.submitted++;
+	return LIBUSB_SUCCESS;
+}
+
+/* Called with the pipeline lock held, for a slot that just left the free list. */
+static inline int usb_pipeline_start_locked(struct usb_pipeline_slot *slot)
+{
+	struct usb_pipeline_endpoint *ep = slot->endpoint;
+	int r = usb_pipeline_submit_locked(slot);
+
+	if (r != LIBUSB_SUCCESS) {
+		slot->next_free = ep->free_list;
+		ep->free_list = slot;
+		return r;
+	}
+
+	ep->pipeline->in_flight++;
+	if (++ep->stats.in_flight > ep->stats.peak_in_flight)
+		ep->stats.peak_in_flight = ep->stats.in_flight;
+	return LIBUSB_SUCCESS;
+}
+
+/* Delivers the pending batch, then recycles or resubmits its transfers.
+ * Event thread only. */
+static inline void usb_pipeline_flush(struct usb_pipeline *p)
+{
+	int i;
+
+	if (p->batch_count == 0)
+		return;
+
+	p->callback(p->callback_data, p->batch, p->batch_count);
+
+	pthread_mutex_lock(&p->lock);
+	p->batches++;
+	for (i = 0; i < p->batch_count; i++) {
+		struct usb_pipeline_slot *slot = p->batch_slots[i];
+		struct usb_pipeline_endpoint *ep = slot->endpoint;
+
+		if (ep->streaming && !p->stop &&
+		    usb_pipeline_submit_locked(slot) == LIBUSB_SUCCESS)
+			continue;
+
+		slot->next_free = ep->free_list;
+		ep->free_list = slot;
+		ep->stats.in_flight--;
+		p->in_flight--;
+	}
+	p->batch_count = 0;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static inline void LIBUSB_CALL usb_pipeline_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct usb_pipeline_slot *slot = (struct usb_pipeline_slot *)transfer->user_data;
+	struct usb_pipeline_endpoint *ep = slot->endpoint;
+	struct usb_pipeline *p = ep->pipeline;
+	struct usb_pipeline_completion *c;
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	ep->stats.completed++;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		ep->stats.errors++;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		for (i = 0; i < transfer->num_iso_packets; i++)
+			ep->stats.bytes += transfer->iso_packet_desc[i].actual_length;
+	} else {
+		ep->stats.bytes += (uint64_t)transfer->actual_length;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	c = &p->batch[p->batch_count];
+	c->endpoint = ep;
+	c->transfer = transfer;
+	c->user_data = slot->user_data;
+	c->sequence = slot->sequence;
+	p->batch_slots[p->batch_count++] = slot;
+
+	if (p->batch_count == p->max_batch)
+		usb_pipeline_flush(p);
+}
+
+static inline void *usb_pipeline_thread(void *arg)
+{
+	struct usb_pipeline *p = (struct usb_pipeline *)arg;
+
+	/* stop is written under the lock by usb_pipeline_free() */
+	while (!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+		struct timeval tv = { 0, 100000 };
+
+		libusb_handle_events_timeout_completed(p->ctx, &tv, NULL);
+		usb_pipeline_flush(p);
+	}
+
+	return NULL;
+}
+
+/** \ingroup usb_pipeline
+ * Creates a pipeline and starts its event thread.
+ *
+ * \param ctx the context whose events the pipeline handles
+ * \param callback batch completion callback
+ * \param user_data passed to \p callback
+ * \param max_batch maximum number of completions per callback, 0 for 64
+ * \returns the pipeline, or NULL on allocation or thread creation failure
+ */
+static inline struct usb_pipeline *usb_pipeline_new(libusb_context *ctx,
+	usb_pipeline_batch_cb callback, void *user_data, int max_batch)
+{
+	struct usb_pipeline *p;
+
+	if (!callback)
+		return NULL;
+
+	p = (struct usb_pipeline *)calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+
+	p->ctx = ctx;
+	p->callback = callback;
+	p->callback_data = user_data;
+	p->max_batch = max_batch > 0 ? max_batch : 64;
+	p->batch = (struct usb_pipeline_completion *)calloc((size_t)p->max_batch, sizeof(*p->batch));
+	p->batch_slots = (struct usb_pipeline_slot **)calloc((size_t)p->max_batch, sizeof(*p->batch_slots));
+	if (!p->batch || !p->batch_slots)
+		goto fail;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	if (pthread_create(&p->thread, NULL, usb_pipeline_thread, p) != 0) {
+		pthread_cond_destroy(&p->cond);
+		pthread_mutex_destroy(&p->lock);
+		goto fail;
+	}
+
+	return p;
+
+fail:
+	free(p->batch_slots);
+	free(p->batch);
+	free(p);
+	return NULL;
+}
+
+/** \ingroup usb_pipeline
+ * Allocates the transfer ring of one endpoint.
+ *
+ * \param p the pipeline
+ * \param dev_handle an open handle with the endpoint's interface claimed
+ * \param endpoint endpoint address, direction bit included
+ * \param type LIBUSB_TRANSFER_TYPE_BULK, _INTERRUPT or _ISOCHRONOUS
+ * \param depth number of transfers that may be in flight at once
+ * \param buffer_length buffer size of each transfer
+ * \param num_iso_packets packets per transfer for isochronous endpoints, 0 otherwise
+ * \param timeout transfer timeout in milliseconds, 0 for none
+ * \returns the endpoint, or NULL on allocation failure or bad arguments
+ */
+static inline struct usb_pipeline_endpoint *usb_pipeline_add_endpoint(
+	struct usb_pipeline *p, libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char type, int depth,
+	int buffer_length, int num_iso_packets, unsigned int timeout)
+{
+	struct usb_pipeline_endpoint *ep;
+	int i;
+
+	if (depth <= 0 || buffer_length <= 0 ||
+	    type == LIBUSB_TRANSFER_TYPE_CONTROL ||
+	    (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) != (num_iso_packets > 0))
+		return NULL;
+
+	ep = (struct usb_pipeline_endpoint *)calloc(1, sizeof(*ep));
+	if (!ep)
+		return NULL;
+
+	ep->slots = (struct usb_pipeline_slot *)calloc((size_t)depth, sizeof(*ep->slots));
+	if (!ep->slots) {
+		free(ep);
+		return NULL;
+	}
+
+	ep->pipeline = p;
+	ep->dev_handle = dev_handle;
+	ep->address = endpoint;
+	ep->type = type;
+	ep->depth = depth;
+	ep->buffer_length = buffer_length;
+	ep->num_iso_packets = num_iso_packets;
+	ep->timeout = timeout;
+
+	for (i = 0; i < depth; i++) {
+		struct usb_pipeline_slot *slot = &ep->slots[i];
+		unsigned char *buffer = (unsigned char *)malloc((size_t)buffer_length);
+
+		slot->transfer = libusb_alloc_transfer(num_iso_packets);
+		if (!slot->transfer || !buffer) {
+			free(buffer);
+			goto fail;
+		}
+
+		slot->endpoint = ep;
+		slot->transfer->dev_handle = dev_handle;
+		slot->transfer->endpoint = endpoint;
+		slot->transfer->type = type;
+		slot->transfer->timeout = timeout;
+		slot->transfer->buffer = buffer;
+		slot->transfer->length = buffer_length;
+		slot->transfer->num_iso_packets = num_iso_packets;
+		slot->transfer->callback = usb_pipeline_transfer_cb;
+		slot->transfer->user_data = slot;
+		slot->transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		slot->next_free = ep->free_list;
+		ep->free_list = slot;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	ep->next = p->endpoints;
+	p->endpoints = ep;
+	pthread_mutex_unlock(&p->lock);
+	return ep;
+
+fail:
+	for (i = 0; i < depth; i++)
+		if (ep->slots[i].transfer)
+			libusb_free_transfer(ep->slots[i].transfer);
+	free(ep->slots);
+	free(ep);
+	return NULL;
+}
+
+/** \ingroup usb_pipeline
+ * Takes a free transfer of the endpoint.
+ *
+ * \param ep the endpoint
+ * \param wait non-zero to block until a transfer completes and frees a slot
+ * \returns a slot whose buffer (usb_pipeline_slot_buffer()) may be filled in
+ * place, or NULL when none is free (and \p wait is zero) or the pipeline is
+ * shutting down
+ */
+static inline struct usb_pipeline_slot *usb_pipeline_acquire(
+	struct usb_pipeline_endpoint *ep, int wait)
+{
+	struct usb_pipeline *p = ep->pipeline;
+	struct usb_pipeline_slot *slot;
+
+	pthread_mutex_lock(&p->lock);
+	while (!ep->free_list && wait && !p->stop)
+		pthread_cond_wait(&p->cond, &p->lock);
+
+	slot = p->stop ? NULL : ep->free_list;
+	if (slot)
+		ep->free_list = slot->next_free;
+	pthread_mutex_unlock(&p->lock);
+	return slot;
+}
+
+static inline unsigned char *usb_pipeline_slot_buffer(struct usb_pipeline_slot *slot)
+{
+	return slot->transfer->buffer;
+}
+
+/* Splits length evenly over the packets, the last one taking the remainder. */
+static inline void usb_pipeline_set_iso_lengths(struct usb_pipeline_slot *slot, int length)
+{
+	int n = slot->endpoint->num_iso_packets;
+
+	if (n <= 0)
+		return;
+	libusb_set_iso_packet_lengths(slot->transfer, (unsigned int)(length / n));
+	slot->transfer->iso_packet_desc[n - 1].length += (unsigned int)(length % n);
+}
+
+/** \ingroup usb_pipeline
+ * Submits an acquired transfer.
+ *
+ * \param slot a slot from usb_pipeline_acquire()
+ * \param length number of bytes to transfer, at most the endpoint buffer length;
+ * isochronous transfers split it evenly over their packets, the last packet
+ * taking the remainder
+ * \param user_data returned in the completion
+ * \returns 0 on success or a LIBUSB_ERROR code, in which case the slot is
+ * back on the free list
+ */
+static inline int usb_pipeline_commit(struct usb_pipeline_slot *slot, int length,
+	void *user_data)
+{
+	struct usb_pipeline_endpoint *ep = slot->endpoint;
+	struct usb_pipeline *p = ep->pipeline;
+	int r;
+
+	if (length < 0 || length > ep->buffer_length)
+		length = ep->buffer_length;
+
+	slot->user_data = user_data;
+	slot->transfer->length = length;
+	usb_pipeline_set_iso_lengths(slot, length);
+
+	pthread_mutex_lock(&p->lock);
+	r = usb_pipeline_start_locked(slot);
+	pthread_mutex_unlock(&p->lock);
+	return r;
+}
+
+/** \ingroup usb_pipeline
+ * Request driven submission, blocking while the endpoint ring is full.
+ *
+ * \param ep the endpoint
+ * \param data payload copied into the transfer for OUT endpoints, NULL for IN
+ * \param length bytes to send or to read
+ * \param user_data returned in the completion
+ * \returns 0 on success or a LIBUSB_ERROR code
+ */
+static inline int usb_pipeline_submit(struct usb_pipeline_endpoint *ep,
+	const unsigned char *data, int length, void *user_data)
+{
+	struct usb_pipeline_slot *slot;
+
+	if (length < 0 || length > ep->buffer_length)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	slot = usb_pipeline_acquire(ep, 1);
+	if (!slot)
+		return LIBUSB_ERROR_INTERRUPTED;
+
+	if (data && length > 0)
+		memcpy(slot->transfer->buffer, data, (size_t)length);
+
+	return usb_pipeline_commit(slot, length, user_data);
+}
+
+/** \ingroup usb_pipeline
+ * Starts streaming on an IN endpoint: every free transfer is submitted with
+ * the full buffer length and resubmitted after its completion was delivered.
+ *
+ * \returns 0 on success or the first LIBUSB_ERROR code hit while submitting
+ */
+static inline int usb_pipeline_stream(struct usb_pipeline_endpoint *ep)
+{
+	struct usb_pipeline *p = ep->pipeline;
+	int r = LIBUSB_SUCCESS;
+
+	if (!(ep->address & LIBUSB_ENDPOINT_IN))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&p->lock);
+	ep->streaming = 1;
+	while (ep->free_list && r == LIBUSB_SUCCESS) {
+		struct usb_pipeline_slot *slot = ep->free_list;
+
+		ep->free_list = slot->next_free;
+		slot->user_data = NULL;
+		slot->transfer->length = ep->buffer_length;
+		usb_pipeline_set_iso_lengths(slot, ep->buffer_length);
+		r = usb_pipeline_start_locked(slot);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return r;
+}
+
+/** \ingroup usb_pipeline
+ * Stops resubmitting on a streaming endpoint. Transfers already in flight
+ * still complete normally.
+ */
+static inline void usb_pipeline_stop_stream(struct usb_pipeline_endpoint *ep)
+{
+	pthread_mutex_lock(&ep->pipeline->lock);
+	ep->streaming = 0;
+	pthread_mutex_unlock(&ep->pipeline->lock);
+}
+
+static inline void usb_pipeline_get_stats(struct usb_pipeline_endpoint *ep,
+	struct usb_pipeline_stats *stats)
+{
+	pthread_mutex_lock(&ep->pipeline->lock);
+	*stats = ep->stats;
+	pthread_mutex_unlock(&ep->pipeline->lock);
+}
+
+/** \ingroup usb_pipeline
+ * Cancels everything still in flight, waits for the cancellations to be
+ * delivered through the batch callback, stops the event thread and frees
+ * all endpoints and transfers.
+ */
+static inline void usb_pipeline_free(struct usb_pipeline *p)
+{
+	struct usb_pipeline_endpoint *ep;
+	int i;
+
+	if (!p)
+		return;
+
+	pthread_mutex_lock(&p->lock);
+	for (ep = p->endpoints; ep; ep = ep->next) {
+		ep->streaming = 0;
+		for (i = 0; i < ep->depth; i++)
+			libusb_cancel_transfer(ep->slots[i].transfer);
+	}
+	while (p->in_flight > 0)
+		pthread_cond_wait(&p->cond, &p->lock);
+	__atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	libusb_interrupt_event_handler(p->ctx);
+#endif
+	pthread_join(p->thread, NULL);
+
+	while ((ep = p->endpoints) != NULL) {
+		p->endpoints = ep->next;
+		for (i = 0; i < ep->depth; i++)
+			libusb_free_transfer(ep->slots[i].transfer);
+		free(ep->slots);
+		free(ep);
+	}
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->batch_slots);
+	free(p->batch);
+	free(p);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USB_PIPELINE_H */
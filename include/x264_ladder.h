@@ -0,0 +1,519 @@
+/*****************************************************************************
+ * x264_ladder.h: ABR ladder front-end sharing frame type decisions
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#ifndef X264_LADDER_H
+#define X264_LADDER_H
+
+/* Encodes the renditions of an ABR ladder from one source.
+ *
+ * Rendition 0, normally the highest resolution, is the master. It is the
+ * only encoder that runs scenecut detection and adaptive B-frame placement
+ * (slicetype_decide, the costliest part of the lookahead with b-adapt 2).
+ * For every frame, the type it chose (IDR, keyframe, I, P, B or BREF) is
+ * forced on the same frame in the other renditions. Those renditions run
+ * with scenecut off and b-adapt none, so they skip that analysis, and all
+ * renditions get identical, aligned GOPs, which ABR switching needs anyway.
+ *
+ * Each rendition encodes on its own worker thread. Input pictures are
+ * queued until the master has decided their type, which takes up to
+ * x264_encoder_maximum_delayed_frames() frames. The total thread budget is
+ * split across the encoders by pixel count.
+ *
+ * The public API gives no access to x264's motion search or MB-tree
+ * propagation data, so those still run per rendition. Per-rendition
+ * rc_lookahead can be lowered to trade quality for speed.
+ *
+ * Threading: x264_ladder_encode() and x264_ladder_flush() must be called
+ * from one thread. Output callbacks run on the calling thread for
+ * rendition 0 and on the rendition's worker thread for all others. */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "x264.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*x264_ladder_output_t)( void *opaque, int i_rendition, x264_nal_t *nal, int i_nal,
+                                      int i_frame_size, x264_picture_t *pic_out );
+
+typedef struct x264_ladder_rendition_t
+{
+    /* resolution, csp, rate control and preset for this rendition.
+     * i_threads == X264_THREADS_AUTO takes a share of the ladder budget. */
+    x264_param_t param;
+    x264_ladder_output_t pf_output;
+    void *opaque;
+} x264_ladder_rendition_t;
+
+typedef struct x264_ladder_stats_t
+{
+    int64_t i_frames;           /* frames fed to the ladder */
+    int64_t i_shared_decisions; /* frame types forced on non-master renditions */
+    int     i_queue_depth;      /* slots per rendition queue */
+} x264_ladder_stats_t;
+
+typedef struct x264_ladder_t x264_ladder_t;
+
+typedef struct
+{
+    x264_picture_t pic;
+    int64_t i_index;
+    void *opaque;
+} x264_ladder_slot_t;
+
+typedef struct
+{
+    x264_ladder_t *ladder;
+    int i_rendition;
+    x264_t *enc;
+    x264_ladder_slot_t *slots;
+    int64_t i_head;             /* next slot to encode */
+    int64_t i_tail;             /* next slot to fill */
+    pthread_t thread;
+    int b_thread;
+    int i_error;
+} x264_ladder_worker_t;
+
+struct x264_ladder_t
+{
+    int i_renditions;
+    x264_ladder_rendition_t *cfg;
+    x264_t *master;
+    x264_ladder_worker_t *workers;  /* renditions 1..n-1 */
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cv_work;    /* workers: new slot or new decision */
+    pthread_cond_t  cv_space;   /* caller: a slot was freed */
+
+    int i_slots;
+    int64_t *decision_index;    /* frame index owning each decision entry */
+    int *decision_type;
+    void **master_opaque;
+    int64_t i_frames;
+    int b_master_done;
+    int b_quit;
+    int64_t i_shared;
+};
+
+/* row size in bytes and row count of plane i, 0 if the plane does not exist */
+static inline int x264_ladder_plane( int i_csp, int i_width, int i_height, int i,
+                                     int *pi_bytes, int *pi_rows )
+{
+    int csp = i_csp & X264_CSP_MASK;
+    int pixel = i_csp & X264_CSP_HIGH_DEPTH ? 2 : 1;
+    int planes, w = i_width, h = i_height;
+
+    switch( csp )
+    {
+        case X264_CSP_I400: planes = 1; break;
+        case X264_CSP_I420:
+        case X264_CSP_YV12: planes = 3; if( i ) { w = (w+1)>>1; h = (h+1)>>1; } break;
+        case X264_CSP_NV12:
+        case X264_CSP_NV21: planes = 2; if( i ) { w = (w+1)&~1; h = (h+1)>>1; } break;
+        case X264_CSP_I422:
+        case X264_CSP_YV16: planes = 3; if( i ) w = (w+1)>>1; break;
+        case X264_CSP_NV16: planes = 2; if( i ) w = (w+1)&~1; break;
+        case X264_CSP_YUYV:
+        case X264_CSP_UYVY: planes = 1; w = ((w+1)&~1) * 2; break;
+        case X264_CSP_I444:
+        case X264_CSP_YV24: planes = 3; break;
+        case X264_CSP_BGR:
+        case X264_CSP_RGB:  planes = 1; w *= 3; break;
+        case X264_CSP_BGRA: planes = 1; w *= 4; break;
+        default: return -1;
+    }
+    if( i >= planes )
+        return 0;
+    *pi_bytes = w * pixel;
+    *pi_rows = h;
+    return 1;
+}
+
+static inline int x264_ladder_copy_picture( x264_picture_t *dst, const x264_picture_t *src,
+                                            const x264_param_t *param )
+{
+    int i, y, bytes, rows, ret;
+
+    if( (src->img.i_csp & ~X264_CSP_VFLIP) != (param->i_csp & ~X264_CSP_VFLIP) )
+        return -1;
+    for( i = 0; i < 4; i++ )
+    {
+        ret = x264_ladder_plane( param->i_csp, param->i_width, param->i_height, i, &bytes, &rows );
+        if( ret < 0 )
+            return -1;
+        if( !ret )
+            break;
+        for( y = 0; y < rows; y++ )
+            memcpy( dst->img.plane[i] + (size_t)y * dst->img.i_stride[i],
+                    src->img.plane[i] + (size_t)y * src->img.i_stride[i], bytes );
+    }
+    dst->img.i_csp = src->img.i_csp;
+    dst->i_pts = src->i_pts;
+    dst->i_pic_struct = src->i_pic_struct;
+    dst->i_qpplus1 = src->i_qpplus1;
+    return 0;
+}
+
+static inline void x264_ladder_emit( x264_ladder_t *h, int i_rendition, x264_nal_t *nal, int i_nal,
+                                     int i_size, x264_picture_t *pic_out )
+{
+    x264_ladder_rendition_t *cfg = &h->cfg[i_rendition];
+    if( i_size > 0 && cfg->pf_output )
+        cfg->pf_output( cfg->opaque, i_rendition, nal, i_nal, i_size, pic_out );
+}
+
+/* record the type the master chose for the frame it just output */
+static inline void x264_ladder_decide( x264_ladder_t *h, x264_picture_t *pic_out )
+{
+    int64_t idx = (int64_t)(intptr_t)pic_out->opaque;
+    int slot = (int)(idx % h->i_slots);
+    int type = pic_out->i_type;
+
+    if( pic_out->b_keyframe && IS_X264_TYPE_I( type ) )
+        type = X264_TYPE_KEYFRAME;
+
+    pthread_mutex_lock( &h->mutex );
+    h->decision_type[slot] = type;
+    h->decision_index[slot] = idx;
+    pic_out->opaque = h->master_opaque[slot];
+    pthread_cond_broadcast( &h->cv_work );
+    pthread_mutex_unlock( &h->mutex );
+}
+
+static inline void *x264_ladder_worker( void *arg )
+{
+    x264_ladder_worker_t *w = (x264_ladder_worker_t*)arg;
+    x264_ladder_t *h = w->ladder;
+    x264_picture_t pic_in, pic_out;
+    x264_nal_t *nal;
+    int i_nal, i_size;
+
+    pthread_mutex_lock( &h->mutex );
+    for( ;; )
+    {
+        x264_ladder_slot_t *s = NULL;
+        int slot;
+
+        while( !h->b_quit )
+        {
+            if( w->i_head < w->i_tail )
+            {
+                s = &w->slots[w->i_head % h->i_slots];
+                slot = (int)(s->i_index % h->i_slots);
+                if( h->decision_index[slot] == s->i_index )
+                    break;
+                s = NULL;
+            }
+            else if( h->b_master_done )
+                break;
+            pthread_cond_wait( &h->cv_work, &h->mutex );
+        }
+        if( !s )
+            break;
+
+        pic_in = s->pic;
+        pic_in.i_type = h->decision_type[slot];
+        pic_in.opaque = s->opaque;
+        h->i_shared++;
+        pthread_mutex_unlock( &h->mutex );
+
+        i_size = x264_encoder_encode( w->enc, &nal, &i_nal, &pic_in, &pic_out );
+        if( i_size > 0 )
+            x264_ladder_emit( h, w->i_rendition, nal, i_nal, i_size, &pic_out );
+
+        pthread_mutex_lock( &h->mutex );
+        if( i_size < 0 && !w->i_error )
+            w->i_error = i_size;
+        w->i_head++;
+        pthread_cond_broadcast( &h->cv_space );
+    }
+    i_size = h->b_quit || w->i_error ? -1 : 0;
+    pthread_mutex_unlock( &h->mutex );
+
+    /* drain the rendition once the master has decided every frame */
+    while( i_size >= 0 && x264_encoder_delayed_frames( w->enc ) )
+    {
+        i_size = x264_encoder_encode( w->enc, &nal, &i_nal, NULL, &pic_out );
+        if( i_size > 0 )
+            x264_ladder_emit( h, w->i_rendition, nal, i_nal, i_size, &pic_out );
+    }
+    if( i_size < 0 )
+    {
+        pthread_mutex_lock( &h->mutex );
+        if( !w->i_error && !h->b_quit )
+            w->i_error = i_size;
+        pthread_mutex_unlock( &h->mutex );
+    }
+    return NULL;
+}
+
+/* x264_ladder_close:
+ *      stop all workers and free everything. Frames not yet flushed are lost. */
+static inline void x264_ladder_close( x264_ladder_t *h )
+{
+    int i, j;
+
+    if( !h )
+        return;
+    pthread_mutex_lock( &h->mutex );
+    h->b_quit = 1;
+    pthread_cond_broadcast( &h->cv_work );
+    pthread_mutex_unlock( &h->mutex );
+
+    for( i = 0; i < h->i_renditions - 1; i++ )
+    {
+        x264_ladder_worker_t *w = &h->workers[i];
+        if( w->b_thread )
+            pthread_join( w->thread, NULL );
+        if( w->enc )
+            x264_encoder_close( w->enc );
+        if( w->slots )
+            for( j = 0; j < h->i_slots; j++ )
+                x264_picture_clean( &w->slots[j].pic );
+        free( w->slots );
+    }
+    if( h->master )
+        x264_encoder_close( h->master );
+    pthread_cond_destroy( &h->cv_space );
+    pthread_cond_destroy( &h->cv_work );
+    pthread_mutex_destroy( &h->mutex );
+    free( h->workers );
+    free( h->decision_index );
+    free( h->decision_type );
+    free( h->master_opaque );
+    free( h->cfg );
+    free( h );
+}
+
+/* x264_ladder_open:
+ *      rend[0] is the master. i_threads is the total thread budget for all
+ *      renditions that use X264_THREADS_AUTO, 0 for one per online cpu.
+ *      rendition frame type options (bframes, pyramid, open-gop, intra
+ *      refresh) are copied from the master so forced types stay valid.
+ *      returns NULL on error. */
+static inline x264_ladder_t *x264_ladder_open( const x264_ladder_rendition_t *rend, int i_renditions,
+                                               int i_threads )
+{
+    x264_ladder_t *h;
+    double total_pixels = 0;
+    int i, j;
+
+    if( i_renditions < 1 )
+        return NULL;
+    h = (x264_ladder_t*)calloc( 1, sizeof(*h) );
+    if( !h )
+        return NULL;
+    pthread_mutex_init( &h->mutex, NULL );
+    pthread_cond_init( &h->cv_work, NULL );
+    pthread_cond_init( &h->cv_space, NULL );
+    h->i_renditions = i_renditions;
+    h->cfg = (x264_ladder_rendition_t*)malloc( i_renditions * sizeof(*h->cfg) );
+    h->workers = (x264_ladder_worker_t*)calloc( i_renditions, sizeof(*h->workers) );
+    if( !h->cfg || !h->workers )
+        goto fail;
+    memcpy( h->cfg, rend, i_renditions * sizeof(*h->cfg) );
+
+    if( i_threads <= 0 )
+        i_threads = (int)sysconf( _SC_NPROCESSORS_ONLN );
+    for( i = 0; i < i_renditions; i++ )
+        total_pixels += (double)rend[i].param.i_width * rend[i].param.i_height;
+
+    for( i = 0; i < i_renditions; i++ )
+    {
+        x264_param_t *p = &h->cfg[i].param;
+        const x264_param_t *m = &h->cfg[0].param;
+
+        if( p->i_threads == X264_THREADS_AUTO && total_pixels > 0 )
+        {
+            p->i_threads = (int)(i_threads * (p->i_width * (double)p->i_height) / total_pixels + 0.5);
+            if( p->i_threads < 1 )
+                p->i_threads = 1;
+        }
+        if( i == 0 )
+            continue;
+        p->i_scenecut_threshold = 0;
+        p->i_bframe_adaptive = X264_B_ADAPT_NONE;
+        p->i_keyint_max = X264_KEYINT_MAX_INFINITE;
+        p->i_bframe = m->i_bframe;
+        p->i_bframe_pyramid = m->i_bframe_pyramid;
+        p->b_open_gop = m->b_open_gop;
+        p->b_intra_refresh = m->b_intra_refresh;
+    }
+
+    h->master = x264_encoder_open( &h->cfg[0].param );
+    if( !h->master )
+        goto fail;
+    h->i_slots = x264_encoder_maximum_delayed_frames( h->master ) + 8;
+    h->decision_index = (int64_t*)malloc( h->i_slots * sizeof(*h->decision_index) );
+    h->decision_type = (int*)calloc( h->i_slots, sizeof(*h->decision_type) );
+    h->master_opaque = (void**)calloc( h->i_slots, sizeof(*h->master_opaque) );
+    if( !h->decision_index || !h->decision_type || !h->master_opaque )
+        goto fail;
+    for( i = 0; i < h->i_slots; i++ )
+        h->decision_index[i] = -1;
+
+    for( i = 1; i < i_renditions; i++ )
+    {
+        x264_ladder_worker_t *w = &h->workers[i-1];
+        x264_param_t *p = &h->cfg[i].param;
+
+        w->ladder = h;
+        w->i_rendition = i;
+        w->enc = x264_encoder_open( p );
+        w->slots = (x264_ladder_slot_t*)calloc( h->i_slots, sizeof(*w->slots) );
+        if( !w->enc || !w->slots )
+            goto fail;
+        for( j = 0; j < h->i_slots; j++ )
+            if( x264_picture_alloc( &w->slots[j].pic, p->i_csp, p->i_width, p->i_height ) < 0 )
+            {
+                /* keep x264_picture_clean() in close away from unallocated slots */
+                for( ; j < h->i_slots; j++ )
+                    x264_picture_init( &w->slots[j].pic );
+                goto fail;
+            }
+        if( pthread_create( &w->thread, NULL, x264_ladder_worker, w ) )
+            goto fail;
+        w->b_thread = 1;
+    }
+    return h;
+
+fail:
+    x264_ladder_close( h );
+    return NULL;
+}
+
+/* x264_ladder_encode:
+ *      pics[i] is the source picture scaled for rendition i; all share one i_pts.
+ *      only image data, i_pts, i_pic_struct and i_qpplus1 are passed on to
+ *      renditions other than 0.
+ *      returns the master's frame size, or negative on error in any rendition. */
+static inline int x264_ladder_encode( x264_ladder_t *h, x264_picture_t **pics )
+{
+    x264_picture_t pic_in, pic_out;
+    x264_nal_t *nal;
+    int64_t idx = h->i_frames++;
+    int i, i_nal, i_size, slot = (int)(idx % h->i_slots);
+
+    for( i = 0; i < h->i_renditions - 1; i++ )
+    {
+        x264_ladder_worker_t *w = &h->workers[i];
+        x264_ladder_slot_t *s;
+        int i_error;
+
+        pthread_mutex_lock( &h->mutex );
+        while( !w->i_error && w->i_tail - w->i_head >= h->i_slots )
+            pthread_cond_wait( &h->cv_space, &h->mutex );
+        i_error = w->i_error;
+        pthread_mutex_unlock( &h->mutex );
+        if( i_error )
+            return i_error;
+
+        /* the slot is ours until i_tail is published */
+        s = &w->slots[w->i_tail % h->i_slots];
+        if( x264_ladder_copy_picture( &s->pic, pics[i+1], &h->cfg[i+1].param ) < 0 )
+            return -1;
+        s->i_index = idx;
+        s->opaque = pics[i+1]->opaque;
+
+        pthread_mutex_lock( &h->mutex );
+        w->i_tail++;
+        pthread_cond_broadcast( &h->cv_work );
+        pthread_mutex_unlock( &h->mutex );
+    }
+
+    pic_in = *pics[0];
+    pic_in.opaque = (void*)(intptr_t)idx;
+    pthread_mutex_lock( &h->mutex );
+    h->master_opaque[slot] = pics[0]->opaque;
+    pthread_mutex_unlock( &h->mutex );
+
+    i_size = x264_encoder_encode( h->master, &nal, &i_nal, &pic_in, &pic_out );
+    if( i_size < 0 )
+        return i_size;
+    if( i_size > 0 )
+    {
+        x264_ladder_decide( h, &pic_out );
+        x264_ladder_emit( h, 0, nal, i_nal, i_size, &pic_out );
+    }
+    return i_size;
+}
+
+/* x264_ladder_flush:
+ *      drain all encoders and wait for the workers. returns 0 or the first error. */
+static inline int x264_ladder_flush( x264_ladder_t *h )
+{
+    x264_picture_t pic_out;
+    x264_nal_t *nal;
+    int i, i_nal, i_size, ret = 0;
+
+    while( x264_encoder_delayed_frames( h->master ) )
+    {
+        i_size = x264_encoder_encode( h->master, &nal, &i_nal, NULL, &pic_out );
+        if( i_size < 0 )
+        {
+            ret = i_size;
+            break;
+        }
+        if( i_size > 0 )
+        {
+            x264_ladder_decide( h, &pic_out );
+            x264_ladder_emit( h, 0, nal, i_nal, i_size, &pic_out );
+        }
+    }
+
+    pthread_mutex_lock( &h->mutex );
+    h->b_master_done = 1;
+    if( ret < 0 )
+        h->b_quit = 1;
+    pthread_cond_broadcast( &h->cv_work );
+    pthread_mutex_unlock( &h->mutex );
+
+    for( i = 0; i < h->i_renditions - 1; i++ )
+    {
+        x264_ladder_worker_t *w = &h->workers[i];
+        if( w->b_thread )
+        {
+            pthread_join( w->thread, NULL );
+            w->b_thread = 0;
+        }
+        if( !ret && w->i_error )
+            ret = w->i_error;
+    }
+    return ret;
+}
+
+static inline void x264_ladder_get_stats( x264_ladder_t *h, x264_ladder_stats_t *stats )
+{
+    pthread_mutex_lock( &h->mutex );
+    stats->i_frames = h->i_frames;
+    stats->i_shared_decisions = h->i_shared;
+    stats->i_queue_depth = h->i_slots;
+    pthread_mutex_unlock( &h->mutex );
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
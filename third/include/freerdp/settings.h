@@ -22,6 +22,8 @@
 #ifndef FREERDP_SETTINGS_H
 #define FREERDP_SETTINGS_H
 
+#include <stddef.h>
+
 #include <winpr/timezone.h>
 
 #include <freerdp/api.h>
@@ -1670,6 +1672,125 @@ extern "C"
 
 	FREERDP_API const void* freerdp_settings_get_pointer(const rdpSettings* settings, size_t id);
 
+	/**
+	 * Unchecked accessors
+	 *
+	 * Every setting with an id sits at the start of its own 64 bit slot in the
+	 * ABI stable zone, at byte offset id * 8. These accessors go straight to
+	 * that slot instead of going through the per id switch of
+	 * freerdp_settings_get_*(), which matters on per PDU paths. The caller
+	 * guarantees that id is a FreeRDP_* id of the accessor's type. Strings
+	 * must still be set with freerdp_settings_set_string(), which owns the
+	 * copy.
+	 */
+
+#define FREERDP_SETTINGS_CONST_SLOT(_settings, _id) \
+	((const BYTE*)(_settings) + ((size_t)(_id) << 3))
+#define FREERDP_SETTINGS_SLOT(_settings, _id) ((BYTE*)(_settings) + ((size_t)(_id) << 3))
+
+	static INLINE BOOL freerdp_settings_get_bool_unchecked(const rdpSettings* settings, size_t id)
+	{
+		return *(const BOOL*)FREERDP_SETTINGS_CONST_SLOT(settings, id);
+	}
+
+	static INLINE void freerdp_settings_set_bool_unchecked(rdpSettings* settings, size_t id,
+	                                                       BOOL param)
+	{
+		*(BOOL*)FREERDP_SETTINGS_SLOT(settings, id) = param;
+	}
+
+	static INLINE INT16 freerdp_settings_get_int16_unchecked(const rdpSettings* settings, size_t id)
+	{
+		return *(const INT16*)FREERDP_SETTINGS_CONST_SLOT(settings, id);
+	}
+
+	static INLINE void freerdp_settings_set_int16_unchecked(rdpSettings* settings, size_t id,
+	                                                        INT16 param)
+	{
+		*(INT16*)FREERDP_SETTINGS_SLOT(settings, id) = param;
+	}
+
+	static INLINE UINT16 freerdp_settings_get_uint16_unchecked(const rdpSettings* settings,
+	                                                           size_t id)
+	{
+		return *(const UINT16*)FREERDP_SETTINGS_CONST_SLOT(settings, id);
+	}
+
+	static INLINE void freerdp_settings_set_uint16_unchecked(rdpSettings* settings, size_t id,
+	                                                         UINT16 param)
+	{
+		*(UINT16*)FREERDP_SETTINGS_SLOT(settings, id) = param;
+	}
+
+	static INLINE INT32 freerdp_settings_get_int32_unchecked(const rdpSettings* settings, size_t id)
+	{
+		return *(const INT32*)FREERDP_SETTINGS_CONST_SLOT(settings, id);
+	}
+
+	static INLINE void freerdp_settings_set_int32_unchecked(rdpSettings* settings, size_t id,
+	                                                        INT32 param)
+	{
+		*(INT32*)FREERDP_SETTINGS_SLOT(settings, id) = param;
+	}
+
+	static INLINE UINT32 freerdp_settings_get_uint32_unchecked(const rdpSettings* settings,
+	                                                           size_t id)
+	{
+		return *(const UINT32*)FREERDP_SETTINGS_CONST_SLOT(settings, id);
+	}
+
+	static INLINE void freerdp_settings_set_uint32_unchecked(rdpSettings* settings, size_t id,
+	                                                         UINT32 param)
+	{
+		*(UINT32*)FREERDP_SETTINGS_SLOT(settings, id) = param;
+	}
+
+	static INLINE INT64 freerdp_settings_get_int64_unchecked(const rdpSettings* settings, size_t id)
+	{
+		return *(const INT64*)FREERDP_SETTINGS_CONST_SLOT(settings, id);
+	}
+
+	static INLINE void freerdp_settings_set_int64_unchecked(rdpSettings* settings, size_t id,
+	                                                        INT64 param)
+	{
+		*(INT64*)FREERDP_SETTINGS_SLOT(settings, id) = param;
+	}
+
+	static INLINE UINT64 freerdp_settings_get_uint64_unchecked(const rdpSettings* settings,
+	                                                           size_t id)
+	{
+		return *(const UINT64*)FREERDP_SETTINGS_CONST_SLOT(settings, id);
+	}
+
+	static INLINE void freerdp_settings_set_uint64_unchecked(rdpSettings* settings, size_t id,
+	                                                         UINT64 param)
+	{
+		*(UINT64*)FREERDP_SETTINGS_SLOT(settings, id) = param;
+	}
+
+	static INLINE const char* freerdp_settings_get_string_unchecked(const rdpSettings* settings,
+	                                                                size_t id)
+	{
+		return *(char* const*)FREERDP_SETTINGS_CONST_SLOT(settings, id);
+	}
+
+	static INLINE const void* freerdp_settings_get_pointer_unchecked(const rdpSettings* settings,
+	                                                                 size_t id)
+	{
+		return *(void* const*)FREERDP_SETTINGS_CONST_SLOT(settings, id);
+	}
+
+	/* Compile time check of the slot layout the unchecked accessors rely on. */
+#define FREERDP_SETTINGS_SLOT_CHECK(_name)                                         \
+	typedef char freerdp_settings_slot_check_##_name                               \
+	    [(offsetof(rdpSettings, _name) == ((size_t)FreeRDP_##_name << 3)) ? 1 : -1]
+
+	FREERDP_SETTINGS_SLOT_CHECK(ServerMode);
+	FREERDP_SETTINGS_SLOT_CHECK(DesktopOrientation);
+	FREERDP_SETTINGS_SLOT_CHECK(MonitorCount);
+	FREERDP_SETTINGS_SLOT_CHECK(TargetNetAddresses);
+	FREERDP_SETTINGS_SLOT_CHECK(TcpAckTimeout);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,532 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Clipboard Virtual Channel Extension - pipelined file contents transfer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREERDP_UTILS_CLIPRDR_FILE_H
+#define FREERDP_UTILS_CLIPRDR_FILE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <winpr/wtypes.h>
+#include <winpr/error.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+#include <winpr/wtsapi.h>
+
+#include <freerdp/channels/cliprdr.h>
+#include <freerdp/client/cliprdr.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/**
+	 * Receiving side.
+	 *
+	 * A CliprdrFileTransfer pulls one file (listIndex of the current file list)
+	 * through FILECONTENTS_RANGE requests, keeping up to `window` requests in
+	 * flight instead of waiting for every response before asking for the next
+	 * chunk. Each response is written with pwrite() straight from the PDU
+	 * buffer to the destination descriptor, so out of order completions need no
+	 * reassembly buffer.
+	 *
+	 * Every outstanding request uses its own streamId, taken from the range
+	 * [streamIdBase, streamIdBase + window). Applications running several
+	 * transfers at once give each one a disjoint range and route responses
+	 * with cliprdr_file_transfer_owns_stream().
+	 *
+	 * The file size is known up front from the FILEDESCRIPTOR of the file list
+	 * (nFileSizeHigh / nFileSizeLow).
+	 */
+
+#define CLIPRDR_FILE_TRANSFER_DEFAULT_CHUNK (1024 * 1024)
+#define CLIPRDR_FILE_TRANSFER_DEFAULT_WINDOW 8
+
+	struct _CLIPRDR_FILE_TRANSFER_STATS
+	{
+		UINT64 bytesTotal;
+		UINT64 bytesDone;
+		UINT32 requestsInFlight;
+		UINT32 requestsSent;
+		UINT64 elapsedMs;
+		UINT64 bytesPerSecond;
+	};
+	typedef struct _CLIPRDR_FILE_TRANSFER_STATS CLIPRDR_FILE_TRANSFER_STATS;
+
+	struct _CLIPRDR_FILE_TRANSFER_SLOT
+	{
+		BOOL busy;
+		UINT64 position;
+		UINT32 requested;
+	};
+	typedef struct _CLIPRDR_FILE_TRANSFER_SLOT CLIPRDR_FILE_TRANSFER_SLOT;
+
+	struct _CliprdrFileTransfer
+	{
+		CliprdrClientContext* context;
+		CRITICAL_SECTION lock;
+
+		int fd;
+		UINT32 listIndex;
+		BOOL haveClipDataId;
+		UINT32 clipDataId;
+
+		UINT64 size;
+		UINT64 nextPosition;
+		UINT32 chunkSize;
+
+		UINT32 streamIdBase;
+		UINT32 window;
+		CLIPRDR_FILE_TRANSFER_SLOT* slots;
+
+		UINT error;
+		UINT64 startTick;
+		UINT64 endTick;
+		CLIPRDR_FILE_TRANSFER_STATS stats;
+	};
+	typedef struct _CliprdrFileTransfer CliprdrFileTransfer;
+
+	static INLINE UINT cliprdr_file_transfer_send(CliprdrFileTransfer* transfer, UINT32 slot,
+	                                              UINT64 position, UINT32 length)
+	{
+		CLIPRDR_FILE_CONTENTS_REQUEST request = { 0 };
+		UINT rc;
+
+		request.msgType = CB_FILECONTENTS_REQUEST;
+		request.streamId = transfer->streamIdBase + slot;
+		request.listIndex = transfer->listIndex;
+		request.dwFlags = FILECONTENTS_RANGE;
+		request.nPositionLow = (UINT32)(position & 0xFFFFFFFF);
+		request.nPositionHigh = (UINT32)(position >> 32);
+		request.cbRequested = length;
+		request.haveClipDataId = transfer->haveClipDataId;
+		request.clipDataId = transfer->clipDataId;
+
+		transfer->slots[slot].busy = TRUE;
+		transfer->slots[slot].position = position;
+		transfer->slots[slot].requested = length;
+		transfer->stats.requestsInFlight++;
+		transfer->stats.requestsSent++;
+
+		rc = transfer->context->ClientFileContentsRequest(transfer->context, &request);
+
+		if (rc != CHANNEL_RC_OK)
+		{
+			transfer->slots[slot].busy = FALSE;
+			transfer->stats.requestsInFlight--;
+		}
+
+		return rc;
+	}
+
+	/* Issues the next chunk on a free slot, if there is anything left to ask for. */
+	static INLINE UINT cliprdr_file_transfer_refill(CliprdrFileTransfer* transfer, UINT32 slot)
+	{
+		UINT64 remaining;
+		UINT32 length;
+		UINT64 position;
+
+		if (transfer->nextPosition >= transfer->size)
+			return CHANNEL_RC_OK;
+
+		remaining = transfer->size - transfer->nextPosition;
+		length = (remaining < transfer->chunkSize) ? (UINT32)remaining : transfer->chunkSize;
+		position = transfer->nextPosition;
+		transfer->nextPosition += length;
+		return cliprdr_file_transfer_send(transfer, slot, position, length);
+	}
+
+	/** creates a transfer for one entry of the file list
+	 * @param context the client clipboard context used to send requests
+	 * @param listIndex index of the file in the FILEDESCRIPTOR list
+	 * @param size file size from the FILEDESCRIPTOR
+	 * @param fd destination descriptor, written with pwrite()
+	 * @param streamIdBase first streamId used by this transfer
+	 * @param chunkSize bytes per request, 0 for the default
+	 * @param window maximum number of outstanding requests, 0 for the default
+	 * @return the new transfer or NULL on failure
+	 */
+	static INLINE CliprdrFileTransfer*
+	cliprdr_file_transfer_new(CliprdrClientContext* context, UINT32 listIndex, UINT64 size, int fd,
+	                          UINT32 streamIdBase, UINT32 chunkSize, UINT32 window)
+	{
+		CliprdrFileTransfer* transfer;
+
+		if (!context || !context->ClientFileContentsRequest || (fd < 0))
+			return NULL;
+
+		transfer = (CliprdrFileTransfer*)calloc(1, sizeof(CliprdrFileTransfer));
+
+		if (!transfer)
+			return NULL;
+
+		transfer->window = window ? window : CLIPRDR_FILE_TRANSFER_DEFAULT_WINDOW;
+		transfer->slots =
+		    (CLIPRDR_FILE_TRANSFER_SLOT*)calloc(transfer->window, sizeof(CLIPRDR_FILE_TRANSFER_SLOT));
+
+		if (!transfer->slots)
+		{
+			free(transfer);
+			return NULL;
+		}
+
+		if (!InitializeCriticalSectionAndSpinCount(&transfer->lock, 4000))
+		{
+			free(transfer->slots);
+			free(transfer);
+			return NULL;
+		}
+
+		transfer->context = context;
+		transfer->listIndex = listIndex;
+		transfer->size = size;
+		transfer->fd = fd;
+		transfer->streamIdBase = streamIdBase;
+		transfer->chunkSize = chunkSize ? chunkSize : CLIPRDR_FILE_TRANSFER_DEFAULT_CHUNK;
+		transfer->stats.bytesTotal = size;
+		transfer->error = CHANNEL_RC_OK;
+		return transfer;
+	}
+
+	static INLINE void cliprdr_file_transfer_free(CliprdrFileTransfer* transfer)
+	{
+		if (!transfer)
+			return;
+
+		DeleteCriticalSection(&transfer->lock);
+		free(transfer->slots);
+		free(transfer);
+	}
+
+	/** restricts the transfer to a locked clipboard data id (CB_LOCK_CLIPDATA) */
+	static INLINE void cliprdr_file_transfer_set_clip_data_id(CliprdrFileTransfer* transfer,
+	                                                          UINT32 clipDataId)
+	{
+		transfer->haveClipDataId = TRUE;
+		transfer->clipDataId = clipDataId;
+	}
+
+	/** fills the request window
+	 * @return CHANNEL_RC_OK or the error returned by ClientFileContentsRequest
+	 */
+	static INLINE UINT cliprdr_file_transfer_start(CliprdrFileTransfer* transfer)
+	{
+		UINT32 slot;
+		UINT rc = CHANNEL_RC_OK;
+
+		if (ftruncate(transfer->fd, (off_t)transfer->size) != 0)
+			return ERROR_WRITE_FAULT;
+
+		EnterCriticalSection(&transfer->lock);
+		transfer->startTick = GetTickCount64();
+
+		for (slot = 0; (slot < transfer->window) && (rc == CHANNEL_RC_OK); slot++)
+			rc = cliprdr_file_transfer_refill(transfer, slot);
+
+		if (rc != CHANNEL_RC_OK)
+			transfer->error = rc;
+
+		LeaveCriticalSection(&transfer->lock);
+		return rc;
+	}
+
+	static INLINE BOOL cliprdr_file_transfer_owns_stream(const CliprdrFileTransfer* transfer,
+	                                                     UINT32 streamId)
+	{
+		return (streamId >= transfer->streamIdBase) &&
+		       (streamId - transfer->streamIdBase < transfer->window);
+	}
+
+	/** consumes a FileContentsResponse, to be called from ServerFileContentsResponse
+	 *
+	 * The payload is written to the destination at the position of the matching
+	 * request and the freed slot immediately asks for the next chunk. A short
+	 * response re-requests the missing tail on the same slot.
+	 *
+	 * @return CHANNEL_RC_OK, ERROR_INVALID_PARAMETER for a foreign or stale
+	 * streamId, or the first error the transfer ran into
+	 */
+	static INLINE UINT cliprdr_file_transfer_on_response(CliprdrFileTransfer* transfer,
+	                                                     const CLIPRDR_FILE_CONTENTS_RESPONSE* response)
+	{
+		CLIPRDR_FILE_TRANSFER_SLOT* slot;
+		UINT32 index;
+		UINT32 received;
+		UINT rc = CHANNEL_RC_OK;
+
+		if (!cliprdr_file_transfer_owns_stream(transfer, response->streamId))
+			return ERROR_INVALID_PARAMETER;
+
+		index = response->streamId - transfer->streamIdBase;
+		EnterCriticalSection(&transfer->lock);
+		slot = &transfer->slots[index];
+
+		if (!slot->busy)
+		{
+			LeaveCriticalSection(&transfer->lock);
+			return ERROR_INVALID_PARAMETER;
+		}
+
+		slot->busy = FALSE;
+		transfer->stats.requestsInFlight--;
+
+		if (transfer->error != CHANNEL_RC_OK)
+			goto out;
+
+		if (response->msgFlags & CB_RESPONSE_FAIL)
+		{
+			transfer->error = ERROR_READ_FAULT;
+			goto out;
+		}
+
+		received = response->cbRequested;
+
+		if (received > slot->requested)
+			received = slot->requested;
+
+		if (received > 0)
+		{
+			const BYTE* data = response->requestedData;
+			size_t left = received;
+			off_t offset = (off_t)slot->position;
+
+			while (left > 0)
+			{
+				ssize_t status = pwrite(transfer->fd, data, left, offset);
+
+				if (status <= 0)
+				{
+					transfer->error = ERROR_WRITE_FAULT;
+					goto out;
+				}
+
+				data += status;
+				offset += status;
+				left -= (size_t)status;
+			}
+
+			transfer->stats.bytesDone += received;
+		}
+
+		if ((received > 0) && (received < slot->requested))
+			rc = cliprdr_file_transfer_send(transfer, index, slot->position + received,
+			                                slot->requested - received);
+		else if (received == 0)
+			transfer->error = ERROR_HANDLE_EOF;
+		else
+			rc = cliprdr_file_transfer_refill(transfer, index);
+
+		if (rc != CHANNEL_RC_OK)
+			transfer->error = rc;
+
+		if ((transfer->stats.bytesDone == transfer->size) && !transfer->endTick)
+			transfer->endTick = GetTickCount64();
+
+	out:
+		rc = transfer->error;
+		LeaveCriticalSection(&transfer->lock);
+		return rc;
+	}
+
+	/** @return TRUE once every byte arrived or the transfer failed and has no request left */
+	static INLINE BOOL cliprdr_file_transfer_is_done(CliprdrFileTransfer* transfer)
+	{
+		BOOL done;
+		EnterCriticalSection(&transfer->lock);
+		done = (transfer->stats.bytesDone == transfer->size) ||
+		       ((transfer->error != CHANNEL_RC_OK) && (transfer->stats.requestsInFlight == 0));
+		LeaveCriticalSection(&transfer->lock);
+		return done;
+	}
+
+	static INLINE UINT cliprdr_file_transfer_get_error(CliprdrFileTransfer* transfer)
+	{
+		UINT error;
+		EnterCriticalSection(&transfer->lock);
+		error = transfer->error;
+		LeaveCriticalSection(&transfer->lock);
+		return error;
+	}
+
+	/** progress and throughput snapshot, safe to call from any thread */
+	static INLINE void cliprdr_file_transfer_get_stats(CliprdrFileTransfer* transfer,
+	                                                   CLIPRDR_FILE_TRANSFER_STATS* stats)
+	{
+		UINT64 now;
+		EnterCriticalSection(&transfer->lock);
+		now = transfer->endTick ? transfer->endTick : GetTickCount64();
+		*stats = transfer->stats;
+		stats->elapsedMs = transfer->startTick ? now - transfer->startTick : 0;
+		stats->bytesPerSecond = stats->elapsedMs ? (stats->bytesDone * 1000) / stats->elapsedMs : 0;
+		LeaveCriticalSection(&transfer->lock);
+	}
+
+	/**
+	 * Sending side.
+	 *
+	 * A CliprdrFileSource keeps a local file open and answers FileContentsRequests
+	 * with pread() into a buffer owned by the source. The file is read rather
+	 * than mapped: another process may truncate it during a transfer, which
+	 * turns a short read into a short response instead of SIGBUS on the
+	 * mapping. The filled response is sent by the caller through whichever
+	 * context it belongs to (ClientFileContentsResponse or
+	 * ServerFileContentsResponse).
+	 */
+
+	struct _CliprdrFileSource
+	{
+		int fd;
+		UINT64 size;
+		BYTE* buffer;
+		UINT32 bufferSize;
+		BYTE sizeBuffer[8];
+	};
+	typedef struct _CliprdrFileSource CliprdrFileSource;
+
+	static INLINE CliprdrFileSource* cliprdr_file_source_new(const char* path)
+	{
+		struct stat st;
+		CliprdrFileSource* source = (CliprdrFileSource*)calloc(1, sizeof(CliprdrFileSource));
+
+		if (!source)
+			return NULL;
+
+		source->fd = open(path, O_RDONLY);
+
+		if ((source->fd < 0) || (fstat(source->fd, &st) != 0))
+			goto fail;
+
+		source->size = (UINT64)st.st_size;
+#if defined(POSIX_FADV_SEQUENTIAL)
+		posix_fadvise(source->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		return source;
+	fail:
+		if (source->fd >= 0)
+			close(source->fd);
+
+		free(source);
+		return NULL;
+	}
+
+	static INLINE void cliprdr_file_source_free(CliprdrFileSource* source)
+	{
+		if (!source)
+			return;
+
+		close(source->fd);
+		free(source->buffer);
+		free(source);
+	}
+
+	/** fills a response for a FILECONTENTS_SIZE or FILECONTENTS_RANGE request
+	 *
+	 * requestedData points into the source and stays valid until the next
+	 * call or cliprdr_file_source_free(). A range past the current end of
+	 * the file, e.g. after a truncation, gets a short or empty response.
+	 */
+	static INLINE void cliprdr_file_source_fill_response(CliprdrFileSource* source,
+	                                                     const CLIPRDR_FILE_CONTENTS_REQUEST* request,
+	                                                     CLIPRDR_FILE_CONTENTS_RESPONSE* response)
+	{
+		memset(response, 0, sizeof(CLIPRDR_FILE_CONTENTS_RESPONSE));
+		response->msgType = CB_FILECONTENTS_RESPONSE;
+		response->msgFlags = CB_RESPONSE_OK;
+		response->streamId = request->streamId;
+
+		if (request->dwFlags & FILECONTENTS_SIZE)
+		{
+			UINT32 i;
+
+			for (i = 0; i < 8; i++)
+				source->sizeBuffer[i] = (BYTE)(source->size >> (8 * i));
+
+			response->cbRequested = 8;
+			response->requestedData = source->sizeBuffer;
+		}
+		else if (request->dwFlags & FILECONTENTS_RANGE)
+		{
+			UINT64 position = ((UINT64)request->nPositionHigh << 32) | request->nPositionLow;
+			UINT64 length = request->cbRequested;
+
+			if (position > source->size)
+				position = source->size;
+
+			if (length > source->size - position)
+				length = source->size - position;
+
+			if (length > source->bufferSize)
+			{
+				BYTE* buffer = (BYTE*)realloc(source->buffer, (size_t)length);
+
+				if (!buffer)
+				{
+					response->msgFlags = CB_RESPONSE_FAIL;
+					length = 0;
+				}
+				else
+				{
+					source->buffer = buffer;
+					source->bufferSize = (UINT32)length;
+				}
+			}
+
+			if (length > 0)
+			{
+				size_t done = 0;
+
+				while (done < length)
+				{
+					ssize_t status = pread(source->fd, source->buffer + done,
+					                       (size_t)length - done, (off_t)(position + done));
+
+					if (status < 0)
+					{
+						response->msgFlags = CB_RESPONSE_FAIL;
+						done = 0;
+						break;
+					}
+
+					if (status == 0)
+						break;
+
+					done += (size_t)status;
+				}
+
+				length = done;
+			}
+
+			response->cbRequested = (UINT32)length;
+			response->requestedData = length ? source->buffer : NULL;
+		}
+		else
+		{
+			response->msgFlags = CB_RESPONSE_FAIL;
+		}
+
+		response->dataLen = 4 + response->cbRequested;
+	}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREERDP_UTILS_CLIPRDR_FILE_H */
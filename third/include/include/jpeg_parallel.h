@@ -0,0 +1,524 @@
+/*
+ * jpeg_parallel.h
+ *
+ * This file is distributed alongside the Independent JPEG Group's software.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * Restart-interval parallel decoding on top of the public libjpeg API.
+ *
+ * A sequential Huffman-coded JPEG with restart markers can be cut at any
+ * restart marker that falls at the start of an MCU row: the DC predictors
+ * and the bit buffer are reset there, so the entropy-coded data from that
+ * point on decodes without anything from before it.  jpeg_read_image_parallel
+ * splits the image into horizontal bands on such boundaries and turns every
+ * band into a small self-contained JPEG stream: the original tables and
+ * frame header with the image height patched, the band's restart intervals
+ * with their RSTn markers renumbered from RST0, and an EOI.  Each band is
+ * then decoded by its own jpeg_decompress_struct on its own thread, straight
+ * into the caller's scanline array.
+ *
+ * Chroma upsampling looks one row beyond each MCU row, so every band is
+ * decoded with one boundary's worth of MCU rows above it and one MCU row
+ * below it, and those rows are thrown away.  The output is therefore
+ * identical to that of a single jpeg_read_scanlines pass.
+ *
+ * Progressive, arithmetic-coded, multi-scan and scaled or color-quantized
+ * decodes, as well as images without restart markers at row boundaries,
+ * take the ordinary single-threaded path through the caller's object.
+ */
+
+#ifndef JPEG_PARALLEL_H
+#define JPEG_PARALLEL_H
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jpeglib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JPAR_MAX_THREADS  64
+
+
+/* Layout of the compressed stream, as found by jpar_scan(). */
+
+typedef struct {
+  JOCTET * header;		/* tables and frame header, SOI through SOS */
+  size_t header_len;
+  size_t sof_height;		/* offset of the height field in header */
+  JDIMENSION mcus_per_row;
+  JDIMENSION mcu_rows;
+  int mcu_height;		/* MCU height in pixels */
+  boolean context_rows;		/* vertical chroma upsampling in use */
+  unsigned int restart_interval; /* in MCUs */
+  const JOCTET * data;		/* the whole stream */
+  size_t * seg;			/* offset of each restart interval */
+  size_t * seg_end;		/* offset just past each interval's data */
+  size_t nseg;
+} jpar_layout;
+
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+} jpar_error_mgr;
+
+typedef struct jpar_band_s jpar_band;
+
+typedef struct {
+  j_decompress_ptr cinfo;	/* the caller's object, for the parameters */
+  const jpar_layout * layout;
+  JSAMPARRAY rows;
+  jpar_band * bands;
+  int nbands;
+  int next;			/* next band to take, atomic */
+  int failed;			/* any band failed, atomic */
+} jpar_job;
+
+struct jpar_band_s {
+  JDIMENSION first_row, end_row; /* MCU rows owned */
+  JDIMENSION decode_row, decode_end; /* MCU rows decoded */
+};
+
+
+static inline unsigned int
+jpar_get16 (const JOCTET * p)
+{
+  return ((unsigned int) GETJOCTET(p[0]) << 8) | GETJOCTET(p[1]);
+}
+
+static inline unsigned int
+jpar_gcd (unsigned int a, unsigned int b)
+{
+  while (b) {
+    unsigned int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static inline void
+jpar_free_layout (jpar_layout * layout)
+{
+  free(layout->header);
+  free(layout->seg);
+  free(layout->seg_end);
+}
+
+/*
+ * Walk the markers up to the first SOS, keeping those the decoder needs,
+ * then find every restart marker in the entropy-coded segment.
+ * Returns FALSE if the stream is not a single interleaved sequential
+ * Huffman scan with restart markers.
+ */
+
+static inline boolean
+jpar_scan (jpar_layout * layout, const JOCTET * data, size_t size)
+{
+  size_t p = 2, hlen = 2, sof = 0, sos_end = 0, cap;
+  JDIMENSION width = 0, height = 0, total;
+  int nf = 0, ci, hmax = 1, vmax = 1, mcu_width;
+
+  memset(layout, 0, sizeof(*layout));
+  layout->data = data;
+  if (size < 4 || GETJOCTET(data[0]) != 0xFF || GETJOCTET(data[1]) != 0xD8)
+    return FALSE;
+  if ((layout->header = (JOCTET *) malloc(size < 65536 ? size : 65536)) == NULL)
+    return FALSE;
+  layout->header[0] = 0xFF;
+  layout->header[1] = 0xD8;
+
+  while (sos_end == 0) {
+    size_t start = p;
+    int marker;
+    unsigned int len;
+
+    while (p < size && GETJOCTET(data[p]) == 0xFF)
+      p++;
+    if (p == start || p >= size)
+      return FALSE;
+    marker = GETJOCTET(data[p++]);
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+      continue;			/* no parameters */
+    if (marker == 0xD8 || marker == 0xD9 || p + 2 > size)
+      return FALSE;
+    len = jpar_get16(data + p);
+    if (len < 2 || p + len > size)
+      return FALSE;
+
+    switch (marker) {
+    case 0xC0:			/* SOF0: baseline */
+    case 0xC1:			/* SOF1: extended sequential, Huffman */
+      if (sof || len < 8)
+	return FALSE;
+      height = jpar_get16(data + p + 3);
+      width = jpar_get16(data + p + 5);
+      nf = GETJOCTET(data[p + 7]);
+      if (height == 0 || width == 0 || nf < 1 || len != 8 + 3 * (unsigned) nf)
+	return FALSE;
+      for (ci = 0; ci < nf; ci++) {
+	int hv = GETJOCTET(data[p + 9 + 3 * ci]);
+	if ((hv >> 4) > hmax) hmax = hv >> 4;
+	if ((hv & 15) > vmax) vmax = hv & 15;
+      }
+      for (ci = 0; ci < nf; ci++)
+	if ((GETJOCTET(data[p + 9 + 3 * ci]) & 15) != vmax)
+	  layout->context_rows = TRUE;
+      sof = hlen + 2 + 3;	/* height field, after FF Cx, Lf and P */
+      break;
+    case 0xC2: case 0xC3: case 0xC5: case 0xC6: case 0xC7:
+    case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+      return FALSE;		/* progressive, lossless, arithmetic... */
+    case 0xDD:			/* DRI */
+      if (len != 4)
+	return FALSE;
+      layout->restart_interval = jpar_get16(data + p + 2);
+      break;
+    case 0xDA:			/* SOS */
+      if (! sof || len != 6 + 2 * (unsigned) nf ||
+	  GETJOCTET(data[p + 2]) != nf ||
+	  GETJOCTET(data[p + 3 + 2 * nf]) != 0 ||	/* Ss */
+	  GETJOCTET(data[p + 4 + 2 * nf]) != 63 ||	/* Se: 8x8 DCT */
+	  GETJOCTET(data[p + 5 + 2 * nf]) != 0)		/* Ah, Al */
+	return FALSE;
+      sos_end = p + len;
+      break;
+    default:
+      break;
+    }
+
+    /* APP1..APP13, APP15 and COM carry nothing the decoder needs */
+    if ((marker >= 0xE1 && marker <= 0xED) || marker == 0xEF || marker == 0xFE) {
+      p += len;
+      continue;
+    }
+    if (hlen + 2 + len > 65536)
+      return FALSE;
+    layout->header[hlen++] = 0xFF;
+    layout->header[hlen++] = (JOCTET) marker;
+    memcpy(layout->header + hlen, data + p, len);
+    hlen += len;
+    p += len;
+  }
+  if (layout->restart_interval == 0)
+    return FALSE;
+  layout->header_len = hlen;
+  layout->sof_height = sof;
+
+  /* A single-component scan is not interleaved: its MCU is one block. */
+  if (nf == 1)
+    hmax = vmax = 1;
+  mcu_width = 8 * hmax;
+  layout->mcu_height = 8 * vmax;
+  layout->mcus_per_row = (width + mcu_width - 1) / mcu_width;
+  layout->mcu_rows = (height + layout->mcu_height - 1) / layout->mcu_height;
+  total = layout->mcus_per_row * layout->mcu_rows;
+  cap = (total + layout->restart_interval - 1) / layout->restart_interval;
+  layout->seg = (size_t *) malloc(cap * sizeof(size_t));
+  layout->seg_end = (size_t *) malloc(cap * sizeof(size_t));
+  if (layout->seg == NULL || layout->seg_end == NULL)
+    return FALSE;
+
+  /* Every RSTn opens a new interval; any other marker ends the scan. */
+  layout->seg[0] = p = sos_end;
+  layout->nseg = 1;
+  for (;;) {
+    const JOCTET * ff = (const JOCTET *) memchr(data + p, 0xFF, size - p);
+    int marker;
+
+    if (ff == NULL || (size_t) (ff - data) + 1 >= size)
+      return FALSE;		/* no EOI */
+    p = (size_t) (ff - data) + 1;
+    marker = GETJOCTET(data[p]);
+    if (marker == 0x00 || marker == 0xFF)
+      continue;			/* stuffed zero or fill byte */
+    if (marker >= 0xD0 && marker <= 0xD7) {
+      if (layout->nseg == cap)
+	return FALSE;
+      layout->seg_end[layout->nseg - 1] = p - 1;
+      layout->seg[layout->nseg++] = p + 1;
+      p++;
+      continue;
+    }
+    layout->seg_end[layout->nseg - 1] = p - 1;
+    break;
+  }
+  return layout->nseg == cap;
+}
+
+/*
+ * Build the stream for one band: the header with the image height of the
+ * decoded rows, the restart intervals covering them renumbered from RST0,
+ * and EOI.  The last interval may run past the rows asked for; the decoder
+ * stops reading once it has the MCUs the frame header promises.
+ */
+
+static inline JOCTET *
+jpar_band_stream (const jpar_layout * layout, JDIMENSION image_height,
+		  const jpar_band * band, size_t * len)
+{
+  size_t first = (size_t) band->decode_row * layout->mcus_per_row /
+		 layout->restart_interval;
+  size_t last = ((size_t) band->decode_end * layout->mcus_per_row - 1) /
+		layout->restart_interval;
+  JDIMENSION top = band->decode_row * layout->mcu_height;
+  JDIMENSION bottom = band->decode_end * layout->mcu_height;
+  JDIMENSION rows = (bottom < image_height ? bottom : image_height) - top;
+  size_t k, n = layout->header_len + 2;
+  JOCTET * buf, * q;
+
+  for (k = first; k <= last; k++)
+    n += layout->seg_end[k] - layout->seg[k] + 2;
+  if ((buf = (JOCTET *) malloc(n)) == NULL)
+    return NULL;
+  memcpy(buf, layout->header, layout->header_len);
+  buf[layout->sof_height] = (JOCTET) (rows >> 8);
+  buf[layout->sof_height + 1] = (JOCTET) rows;
+  q = buf + layout->header_len;
+  for (k = first; k <= last; k++) {
+    size_t seglen = layout->seg_end[k] - layout->seg[k];
+    memcpy(q, layout->data + layout->seg[k], seglen);
+    q += seglen;
+    if (k < last) {
+      *q++ = 0xFF;
+      *q++ = (JOCTET) (0xD0 + ((k - first) & 7));
+    }
+  }
+  *q++ = 0xFF;
+  *q++ = 0xD9;
+  *len = (size_t) (q - buf);
+  return buf;
+}
+
+static inline void
+jpar_error_exit (j_common_ptr cinfo)
+{
+  jpar_error_mgr * err = (jpar_error_mgr *) cinfo->err;
+  longjmp(err->setjmp_buffer, 1);
+}
+
+/* A corrupt-data warning in a band means the split went wrong: give up. */
+
+static inline void
+jpar_emit_message (j_common_ptr cinfo, int msg_level)
+{
+  if (msg_level < 0)
+    jpar_error_exit(cinfo);
+}
+
+static inline boolean
+jpar_decode_band (jpar_job * job, const jpar_band * band)
+{
+  const jpar_layout * layout = job->layout;
+  j_decompress_ptr src = job->cinfo;
+  struct jpeg_decompress_struct cinfo;
+  jpar_error_mgr jerr;
+  JOCTET * volatile stream;
+  JSAMPROW volatile scratch;
+  JDIMENSION keep0, keep1;
+  volatile JDIMENSION y;
+  volatile size_t len;
+  size_t n = 0;
+
+  keep0 = band->first_row * layout->mcu_height;
+  keep1 = band->end_row * layout->mcu_height < src->output_height ?
+	  band->end_row * layout->mcu_height : src->output_height;
+  y = band->decode_row * layout->mcu_height;
+
+  /* Everything the error path frees is set up before the setjmp. */
+  stream = jpar_band_stream(layout, src->image_height, band, &n);
+  len = n;
+  scratch = (JSAMPROW) malloc((size_t) src->output_width *
+			      src->output_components * sizeof(JSAMPLE));
+  if (stream == NULL || scratch == NULL) {
+    free(stream);
+    free(scratch);
+    return FALSE;
+  }
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpar_error_exit;
+  jerr.pub.emit_message = jpar_emit_message;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    free(stream);
+    free(scratch);
+    return FALSE;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, stream, (unsigned long) len);
+  jpeg_read_header(&cinfo, TRUE);
+
+  cinfo.out_color_space = src->out_color_space;
+  cinfo.output_gamma = src->output_gamma;
+  cinfo.dct_method = src->dct_method;
+  cinfo.do_fancy_upsampling = src->do_fancy_upsampling;
+  cinfo.do_block_smoothing = src->do_block_smoothing;
+  jpeg_start_decompress(&cinfo);
+  if (cinfo.output_width != src->output_width ||
+      cinfo.output_components != src->output_components)
+    jpar_error_exit((j_common_ptr) &cinfo);
+
+  while (cinfo.output_scanline < cinfo.output_height && y < keep1) {
+    JSAMPROW row = y >= keep0 ? job->rows[y] : scratch;
+    if (__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+      jpar_error_exit((j_common_ptr) &cinfo);
+    if (jpeg_read_scanlines(&cinfo, &row, 1) != 1)
+      jpar_error_exit((j_common_ptr) &cinfo);
+    y++;
+  }
+  jpeg_destroy_decompress(&cinfo);
+  free(stream);
+  free(scratch);
+  return y == keep1;
+}
+
+static inline void *
+jpar_worker (void * arg)
+{
+  jpar_job * job = (jpar_job *) arg;
+  int i;
+
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nbands) {
+    if (! jpar_decode_band(job, &job->bands[i]))
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/*
+ * Split the MCU rows into bands starting on restart boundaries that are
+ * also row boundaries.  Each band is decoded from one such boundary
+ * earlier when chroma is upsampled vertically, so its first owned row has
+ * real context above it.  Returns the number of bands.
+ */
+
+static inline int
+jpar_plan (const jpar_layout * layout, int threads, jpar_band * bands)
+{
+  JDIMENSION unit, rows = layout->mcu_rows, band_rows = rows;
+  int n = threads, i;
+
+  /* MCU rows between two row-aligned restart markers */
+  unit = layout->restart_interval /
+	 jpar_gcd(layout->restart_interval, layout->mcus_per_row);
+  for (; n > 1; n--) {
+    band_rows = (rows + n - 1) / n;
+    band_rows = (band_rows + unit - 1) / unit * unit;
+    if (band_rows >= 2 * unit || (! layout->context_rows && band_rows >= unit))
+      break;
+  }
+  if (n <= 1)
+    return 1;
+
+  for (i = 0; i < n; i++) {
+    jpar_band * b = &bands[i];
+    b->first_row = (JDIMENSION) i * band_rows;
+    if (b->first_row >= rows)
+      break;
+    b->end_row = b->first_row + band_rows < rows ? b->first_row + band_rows : rows;
+    b->decode_row = b->first_row;
+    b->decode_end = b->end_row;
+    if (layout->context_rows) {
+      if (b->decode_row)
+	b->decode_row -= unit;
+      if (b->decode_end < rows)
+	b->decode_end++;
+    }
+  }
+  return i;
+}
+
+/*
+ * jpeg_read_image_parallel replaces the jpeg_start_decompress,
+ * jpeg_read_scanlines, jpeg_finish_decompress sequence.  Call it after
+ * jpeg_read_header and after setting any decompression parameters; data
+ * and size must be the whole stream given to the data source.  rows must
+ * hold output_height rows of output_width * output_components samples
+ * (jpeg_calc_output_dimensions computes these in advance).
+ *
+ * threads is the number of threads to use, 0 for one per online
+ * processor.  Returns the number of scanlines read.  On return cinfo is
+ * idle, ready for jpeg_destroy_decompress or another image.
+ *
+ * Errors are reported through cinfo's error manager: if the parallel
+ * path cannot be used or any band fails, the image is decoded once more
+ * on the calling thread through cinfo.
+ */
+
+static inline JDIMENSION
+jpeg_read_image_parallel (j_decompress_ptr cinfo, const JOCTET * data,
+			  size_t size, JSAMPARRAY rows, int threads)
+{
+  pthread_t tid[JPAR_MAX_THREADS];
+  jpar_band bands[JPAR_MAX_THREADS];
+  jpar_layout layout;
+  jpar_job job;
+  int started = 0, i;
+  JDIMENSION n;
+
+  if (threads <= 0)
+    threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > JPAR_MAX_THREADS)
+    threads = JPAR_MAX_THREADS;
+
+  if (threads > 1 && ! cinfo->progressive_mode && ! cinfo->arith_code &&
+      ! cinfo->buffered_image && ! cinfo->raw_data_out &&
+      ! cinfo->quantize_colors && cinfo->scale_num == cinfo->scale_denom) {
+    boolean ok = jpar_scan(&layout, data, size);
+
+    memset(&job, 0, sizeof(job));
+    if (ok) {
+      jpeg_calc_output_dimensions(cinfo);
+      job.nbands = jpar_plan(&layout, threads, bands);
+      ok = job.nbands > 1 && cinfo->output_height == cinfo->image_height;
+    }
+    if (ok) {
+      job.cinfo = cinfo;
+      job.layout = &layout;
+      job.rows = rows;
+      job.bands = bands;
+      /* the calling thread is one of the workers */
+      for (; started < job.nbands - 1; started++)
+	if (pthread_create(&tid[started], NULL, jpar_worker, &job))
+	  break;
+      jpar_worker(&job);
+      for (i = 0; i < started; i++)
+	pthread_join(tid[i], NULL);
+      ok = ! job.failed;
+    }
+    jpar_free_layout(&layout);
+    if (ok) {
+      n = cinfo->output_height;
+      jpeg_abort_decompress(cinfo);
+      return n;
+    }
+  }
+
+  jpeg_start_decompress(cinfo);
+  while (cinfo->output_scanline < cinfo->output_height) {
+    n = jpeg_read_scanlines(cinfo, rows + cinfo->output_scanline,
+			    cinfo->output_height - cinfo->output_scanline);
+    if (n == 0)
+      break;
+  }
+  n = cinfo->output_scanline;
+  if (n == cinfo->output_height)
+    jpeg_finish_decompress(cinfo);
+  else
+    jpeg_abort_decompress(cinfo);
+  return n;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JPEG_PARALLEL_H */
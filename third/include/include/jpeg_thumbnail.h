@@ -0,0 +1,398 @@
+/*
+ * jpeg_thumbnail.h
+ *
+ * This file is distributed alongside the Independent JPEG Group's software.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * Thumbnail-oriented decoding on top of the public libjpeg API.
+ *
+ * A thumbnail needs far fewer pixels than the full image, and libjpeg can
+ * produce most of that reduction for free: with scale_num/scale_denom set
+ * to M/8 each 8x8 block goes through an MxM inverse DCT, so the image comes
+ * out already downscaled and the upsampling and color conversion run on
+ * the smaller image.  jpeg_thumb_set_scale picks the smallest such scale
+ * that still covers the requested size, leaving the final resize to the
+ * caller on an image at most twice as large as wanted.  At 1/8 the 1x1
+ * IDCT only reads the DC coefficient; fancy upsampling is turned off
+ * there as well, so an extreme downscale decodes little beyond the
+ * Huffman data.
+ *
+ * For a crop, output stops at the last scanline needed.  When the image
+ * has restart markers at MCU row boundaries, the rows above the crop are
+ * skipped too: decoding starts at the last such boundary above the crop,
+ * using the band streams of jpeg_parallel.h.  Columns outside the crop
+ * are decoded and dropped, since the Huffman data can only be read in
+ * order and libjpeg offers no column crop.
+ *
+ * jpeg_thumb_decode_batch decodes many thumbnails on a pool of threads,
+ * one jpeg_decompress_struct per image, and reports the throughput.
+ */
+
+#ifndef JPEG_THUMBNAIL_H
+#define JPEG_THUMBNAIL_H
+
+#include <time.h>
+
+#include "jpeg_parallel.h"
+#include "jerror.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JPEG_THUMB_MAX_THREADS  JPAR_MAX_THREADS
+
+
+/* Region of the source image, in source pixels.  width 0 = whole image. */
+
+typedef struct {
+  JDIMENSION x, y;
+  JDIMENSION width, height;
+} jpeg_thumb_region;
+
+/* One thumbnail to decode. */
+
+typedef struct {
+  /* Filled in by the caller */
+  const JOCTET * data;		/* the whole JPEG stream */
+  size_t size;
+  JDIMENSION target_width;	/* smallest acceptable size, 0 = any */
+  JDIMENSION target_height;
+  jpeg_thumb_region crop;	/* all zero for the whole image */
+  J_COLOR_SPACE out_color_space; /* JCS_UNKNOWN for the library default */
+
+  /* Filled in by jpeg_thumb_decode */
+  JSAMPLE * pixels;		/* malloc'd, rows of width * components */
+  JDIMENSION width, height;
+  int components;
+  unsigned int scale_num;	/* DCT scale used, over 8 */
+  boolean skipped_rows;		/* rows above the crop were not decoded */
+  int status;			/* 0 = ok, else the libjpeg message code */
+  char message[JMSG_LENGTH_MAX];
+} jpeg_thumb_job;
+
+/* Throughput of one jpeg_thumb_decode_batch call. */
+
+typedef struct {
+  size_t images;		/* thumbnails decoded */
+  size_t failed;		/* jobs with status != 0 */
+  int threads;			/* threads used */
+  double seconds;		/* wall time */
+  double per_second_per_core;	/* images / seconds / threads */
+} jpeg_thumb_stats;
+
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+} jpeg_thumb_error_mgr;
+
+
+/*
+ * Choose the DCT scale for a thumbnail of at least target_width x
+ * target_height from a source region of src_width x src_height (a target
+ * of 0 places no constraint on that dimension), and set the decompression
+ * parameters for it.  Call after jpeg_read_header.  Returns the scale
+ * numerator, over a denominator of 8.
+ */
+
+static inline unsigned int
+jpeg_thumb_set_scale (j_decompress_ptr cinfo,
+		      JDIMENSION target_width, JDIMENSION target_height,
+		      JDIMENSION src_width, JDIMENSION src_height)
+{
+  unsigned int num;
+
+  for (num = 1; num < 8; num++) {
+    unsigned long w = ((unsigned long) src_width * num + 7) / 8;
+    unsigned long h = ((unsigned long) src_height * num + 7) / 8;
+    if (w >= target_width && h >= target_height)
+      break;
+  }
+  cinfo->scale_num = num;
+  cinfo->scale_denom = 8;
+  if (num < 8)
+    cinfo->dct_method = JDCT_FASTEST;
+  if (num == 1)			/* DC only */
+    cinfo->do_fancy_upsampling = FALSE;
+  return num;
+}
+
+static inline void
+jpeg_thumb_error_exit (j_common_ptr cinfo)
+{
+  jpeg_thumb_error_mgr * err = (jpeg_thumb_error_mgr *) cinfo->err;
+  longjmp(err->setjmp_buffer, 1);
+}
+
+/* Warnings are not printed; a service decoding untrusted files sees many. */
+
+static inline void
+jpeg_thumb_emit_message (j_common_ptr cinfo, int msg_level)
+{
+  if (msg_level < 0)
+    cinfo->err->num_warnings++;
+}
+
+/* The job's parameters, applied again if decoding moves to a skip stream. */
+
+static inline unsigned int
+jpeg_thumb_setup (j_decompress_ptr cinfo, const jpeg_thumb_job * job,
+		  const jpeg_thumb_region * crop)
+{
+  if (job->out_color_space != JCS_UNKNOWN)
+    cinfo->out_color_space = job->out_color_space;
+  return jpeg_thumb_set_scale(cinfo, job->target_width, job->target_height,
+			      crop->width, crop->height);
+}
+
+/*
+ * Build the stream that starts at the last row-aligned restart boundary
+ * far enough above src_y0 to give its first row upsampling context, and
+ * ends an MCU row below src_y1.  Returns NULL when the stream has no such
+ * boundary above the crop or cannot be split.  *top receives the first
+ * source MCU row of the new stream; it is left alone when NULL is returned.
+ */
+
+static inline JOCTET *
+jpeg_thumb_skip_stream (const jpeg_thumb_job * job, JDIMENSION src_y0,
+			JDIMENSION src_y1, JDIMENSION image_height,
+			JDIMENSION * top, int * mcu_height, size_t * len)
+{
+  jpar_layout layout;
+  jpar_band band;
+  JOCTET * stream = NULL;
+  JDIMENSION unit, row;
+
+  if (jpar_scan(&layout, job->data, job->size)) {
+    unit = layout.restart_interval /
+	   jpar_gcd(layout.restart_interval, layout.mcus_per_row);
+    row = src_y0 / layout.mcu_height;
+    if (layout.context_rows && row)
+      row--;
+    band.decode_row = row / unit * unit;
+    band.decode_end = (src_y1 + layout.mcu_height - 1) / layout.mcu_height;
+    if (layout.context_rows)
+      band.decode_end++;
+    if (band.decode_end > layout.mcu_rows)
+      band.decode_end = layout.mcu_rows;
+    if (band.decode_row > 0) {
+      band.first_row = band.decode_row;
+      band.end_row = band.decode_end;
+      stream = jpar_band_stream(&layout, image_height, &band, len);
+      if (stream != NULL) {
+	*top = band.decode_row;
+	*mcu_height = layout.mcu_height;
+      }
+    }
+  }
+  jpar_free_layout(&layout);
+  return stream;
+}
+
+/* What the error path has to release, kept out of setjmp's way. */
+
+typedef struct {
+  struct jpeg_decompress_struct cinfo;
+  jpeg_thumb_error_mgr jerr;
+  JOCTET * stream;		/* skip stream, if any */
+  JSAMPROW scratch;		/* one full output row */
+} jpeg_thumb_state;
+
+/* The body of jpeg_thumb_decode; errors leave through the error manager. */
+
+static inline void
+jpeg_thumb_run (jpeg_thumb_job * job, jpeg_thumb_state * st)
+{
+  j_decompress_ptr cinfo = &st->cinfo;
+  jpeg_thumb_region crop;
+  JDIMENSION ox0, ox1, oy0, oy1, y, top = 0;
+  unsigned int num;
+  int mcu_height = 8;
+  size_t len = 0, row_bytes;
+
+  jpeg_mem_src(cinfo, (JOCTET *) job->data, (unsigned long) job->size);
+  jpeg_read_header(cinfo, TRUE);
+
+  crop = job->crop;
+  if (crop.width == 0 || crop.height == 0) {
+    crop.x = crop.y = 0;
+    crop.width = cinfo->image_width;
+    crop.height = cinfo->image_height;
+  }
+  if (crop.x >= cinfo->image_width || crop.y >= cinfo->image_height)
+    ERREXIT(cinfo, JERR_BAD_CROP_SPEC);
+  if (crop.width > cinfo->image_width - crop.x)
+    crop.width = cinfo->image_width - crop.x;
+  if (crop.height > cinfo->image_height - crop.y)
+    crop.height = cinfo->image_height - crop.y;
+
+  num = jpeg_thumb_setup(cinfo, job, &crop);
+  if (crop.y > 0 && ! cinfo->progressive_mode && ! cinfo->arith_code)
+    st->stream = jpeg_thumb_skip_stream(job, crop.y, crop.y + crop.height,
+					cinfo->image_height, &top, &mcu_height,
+					&len);
+  if (st->stream != NULL) {
+    /* Same tables, fewer rows: start over on the shortened stream. */
+    jpeg_abort_decompress(cinfo);
+    jpeg_mem_src(cinfo, st->stream, (unsigned long) len);
+    jpeg_read_header(cinfo, TRUE);
+    jpeg_thumb_setup(cinfo, job, &crop);
+    job->skipped_rows = TRUE;
+  }
+  jpeg_start_decompress(cinfo);
+
+  /* Crop in output rows and columns; top is in source MCU rows. */
+  top = top * (JDIMENSION) mcu_height * num / 8;
+  ox0 = crop.x * num / 8;
+  ox1 = (JDIMENSION) (((unsigned long) (crop.x + crop.width) * num + 7) / 8);
+  oy0 = crop.y * num / 8;
+  oy1 = (JDIMENSION) (((unsigned long) (crop.y + crop.height) * num + 7) / 8);
+  if (ox1 > cinfo->output_width)
+    ox1 = cinfo->output_width;
+  if (oy1 > top + cinfo->output_height)
+    oy1 = top + cinfo->output_height;
+  if (ox1 <= ox0 || oy1 <= oy0)
+    ERREXIT(cinfo, JERR_BAD_CROP_SPEC);
+
+  job->scale_num = num;
+  job->components = cinfo->output_components;
+  row_bytes = (size_t) (ox1 - ox0) * cinfo->output_components;
+  st->scratch = (JSAMPROW) malloc((size_t) cinfo->output_width *
+				  cinfo->output_components * sizeof(JSAMPLE));
+  job->pixels = (JSAMPLE *) malloc(row_bytes * (oy1 - oy0) * sizeof(JSAMPLE));
+  if (st->scratch == NULL || job->pixels == NULL)
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+
+  for (y = top; y < oy1; y++) {
+    JSAMPROW row = st->scratch;
+    if (jpeg_read_scanlines(cinfo, &row, 1) != 1)
+      ERREXIT(cinfo, JERR_INPUT_EMPTY);
+    if (y >= oy0)
+      memcpy(job->pixels + (y - oy0) * row_bytes,
+	     st->scratch + (size_t) ox0 * cinfo->output_components, row_bytes);
+  }
+  job->width = ox1 - ox0;
+  job->height = oy1 - oy0;
+
+  /* Nothing below the crop is wanted. */
+  jpeg_abort_decompress(cinfo);
+}
+
+/*
+ * Decode one thumbnail as described by job, filling in its output fields.
+ * Returns TRUE on success; on failure job->status and job->message say
+ * why and job->pixels is NULL.
+ */
+
+static inline boolean
+jpeg_thumb_decode (jpeg_thumb_job * job)
+{
+  jpeg_thumb_state st;
+
+  job->pixels = NULL;
+  job->width = job->height = 0;
+  job->skipped_rows = FALSE;
+  job->status = 0;
+  job->message[0] = '\0';
+
+  st.stream = NULL;
+  st.scratch = NULL;
+  st.cinfo.err = jpeg_std_error(&st.jerr.pub);
+  st.jerr.pub.error_exit = jpeg_thumb_error_exit;
+  st.jerr.pub.emit_message = jpeg_thumb_emit_message;
+  if (setjmp(st.jerr.setjmp_buffer)) {
+    job->status = st.jerr.pub.msg_code;
+    (*st.jerr.pub.format_message) ((j_common_ptr) &st.cinfo, job->message);
+    jpeg_destroy_decompress(&st.cinfo);
+    free(st.stream);
+    free(st.scratch);
+    free(job->pixels);
+    job->pixels = NULL;
+    return FALSE;
+  }
+  jpeg_create_decompress(&st.cinfo);
+  jpeg_thumb_run(job, &st);
+  jpeg_destroy_decompress(&st.cinfo);
+  free(st.stream);
+  free(st.scratch);
+  return TRUE;
+}
+
+typedef struct {
+  jpeg_thumb_job * jobs;
+  size_t njobs;
+  size_t next;			/* next job to take, atomic */
+} jpeg_thumb_batch;
+
+static inline void *
+jpeg_thumb_worker (void * arg)
+{
+  jpeg_thumb_batch * batch = (jpeg_thumb_batch *) arg;
+  size_t i;
+
+  while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->njobs)
+    jpeg_thumb_decode(&batch->jobs[i]);
+  return NULL;
+}
+
+/*
+ * Decode njobs thumbnails with up to threads threads (0 for one per
+ * online processor).  Each job's output fields are filled in as by
+ * jpeg_thumb_decode.  If stats is not NULL it receives the count of
+ * thumbnails, the wall time, and thumbnails per second per core.
+ */
+
+static inline void
+jpeg_thumb_decode_batch (jpeg_thumb_job * jobs, size_t njobs, int threads,
+			 jpeg_thumb_stats * stats)
+{
+  pthread_t tid[JPEG_THUMB_MAX_THREADS];
+  jpeg_thumb_batch batch;
+  struct timespec t0, t1;
+  int started = 0, i;
+  size_t k;
+
+  if (threads <= 0)
+    threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1)
+    threads = 1;
+  if (threads > JPEG_THUMB_MAX_THREADS)
+    threads = JPEG_THUMB_MAX_THREADS;
+  if ((size_t) threads > njobs)
+    threads = njobs ? (int) njobs : 1;
+
+  batch.jobs = jobs;
+  batch.njobs = njobs;
+  batch.next = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  /* the calling thread is one of the workers */
+  for (; started < threads - 1; started++)
+    if (pthread_create(&tid[started], NULL, jpeg_thumb_worker, &batch))
+      break;
+  jpeg_thumb_worker(&batch);
+  for (i = 0; i < started; i++)
+    pthread_join(tid[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  if (stats != NULL) {
+    memset(stats, 0, sizeof(*stats));
+    for (k = 0; k < njobs; k++) {
+      if (jobs[k].status)
+	stats->failed++;
+      else
+	stats->images++;
+    }
+    stats->threads = started + 1;
+    stats->seconds = (double) (t1.tv_sec - t0.tv_sec) +
+		     (double) (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (stats->seconds > 0)
+      stats->per_second_per_core = (double) stats->images /
+				   stats->seconds / stats->threads;
+  }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JPEG_THUMBNAIL_H */
@@ -0,0 +1,412 @@
+/* png_parallel.h - multi-threaded IDAT encoder for libpng
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ */
+
+/* png_write_image_parallel() replaces png_write_image() and png_write_end()
+ * for large non-interlaced images.  The rows are cut into groups; every group
+ * is filtered and deflated on its own thread, and the raw deflate pieces are
+ * joined into one zlib stream exactly as in zlib_parallel.h: each group is
+ * primed with the previous 32K of filtered bytes and ends on a sync flush,
+ * and the Adler-32 values of the groups are merged with adler32_combine().
+ * Each group goes out as one IDAT chunk.
+ *
+ * The filter heuristic is libpng's: per row, the candidate filter with the
+ * smallest sum of absolute (signed) output bytes.  A group recomputes the
+ * filters of the rows that form its dictionary, which gives the same bytes
+ * as the group before it since the choice only depends on the image.
+ *
+ * Limitations:
+ *  - rows are written as given: libpng write transforms (png_set_bgr(),
+ *    png_set_swap(), filler, ...) are not applied, so 16-bit samples must
+ *    already be big-endian;
+ *  - interlaced images are rejected;
+ *  - chunks placed after the image data in info_ptr are not written;
+ *  - the encoded image is held in memory until it is written.
+ */
+
+#ifndef PNG_PARALLEL_H
+#define PNG_PARALLEL_H
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "png.h"
+#include "zlib_checksum.h"
+#include "zlib_parallel.h"
+
+#if defined(__SSE2__) && defined(__x86_64__)
+#  define PNG_PARALLEL_SSE2
+#  include <emmintrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Raw bytes per group.  Groups are the unit of work and of IDAT chunks. */
+#define PNG_PARALLEL_GROUP_BYTES (256 * 1024)
+#define PNG_PARALLEL_WINDOW      32768
+
+typedef struct png_parallel_group
+{
+   png_uint_32 row0, row1;    /* rows compressed by this group */
+   png_bytep   out;
+   size_t      out_len;
+   uLong       adler;
+   size_t      raw_len;
+   int         err;
+} png_parallel_group;
+
+typedef struct png_parallel_job
+{
+   png_const_bytep const *rows;
+   size_t       rowbytes;
+   unsigned int bpp;          /* bytes per complete pixel, at least 1 */
+   int          filters;      /* PNG_FILTER_* mask */
+   int          level;
+   int          strategy;
+   png_uint_32  ngroups;
+   png_uint_32  next;         /* next group to take, atomic */
+   png_parallel_group *groups;
+} png_parallel_job;
+
+/* Sum of |(signed char)v| over a filtered row, libpng's selection metric. */
+static inline size_t
+png_parallel_row_cost(png_const_bytep p, size_t n)
+{
+   size_t sum = 0, i = 0;
+
+#ifdef PNG_PARALLEL_SSE2
+   {
+      const __m128i zero = _mm_setzero_si128();
+      __m128i acc = zero;
+
+      for (; i + 16 <= n; i += 16)
+      {
+         __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+         /* min(v, 256 - v) is the magnitude of v as a signed byte */
+         v = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+         acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+      }
+      sum = (size_t)_mm_cvtsi128_si64(acc) +
+            (size_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+   }
+#endif
+   for (; i < n; i++)
+      sum += p[i] < 128 ? p[i] : 256 - p[i];
+
+   return sum;
+}
+
+/* Filter one row into out[0..rowbytes] (filter type byte first).  prev is
+ * NULL for the first row of the image.  scratch holds 4 * (rowbytes + 1)
+ * bytes.  The loops only read the raw rows, so the compiler vectorizes them.
+ */
+static inline void
+png_parallel_filter_row(const png_parallel_job *job, png_const_bytep prev,
+    png_const_bytep row, png_bytep out, png_bytep scratch)
+{
+   size_t n = job->rowbytes, bpp = job->bpp, i, cost, best_cost;
+   int filters = job->filters;
+   png_bytep cand[5];
+   int best = PNG_FILTER_VALUE_NONE, f;
+
+   /* The first row has no upper neighbour; only None and Sub are tried. */
+   if (prev == NULL)
+      filters &= ~(PNG_FILTER_UP | PNG_FILTER_AVG | PNG_FILTER_PAETH);
+   if ((filters & PNG_ALL_FILTERS) == 0)
+      filters = PNG_FILTER_NONE;
+
+   cand[PNG_FILTER_VALUE_NONE] = out;
+   for (f = PNG_FILTER_VALUE_SUB; f < PNG_FILTER_VALUE_LAST; f++)
+      cand[f] = scratch + (size_t)(f - 1) * (n + 1);
+
+   out[0] = PNG_FILTER_VALUE_NONE;
+   memcpy(out + 1, row, n);
+   best_cost = (filters & PNG_FILTER_NONE) != 0 ?
+       png_parallel_row_cost(out + 1, n) : (size_t)-1;
+
+   if ((filters & PNG_FILTER_SUB) != 0)
+   {
+      png_bytep d = cand[PNG_FILTER_VALUE_SUB] + 1;
+      for (i = 0; i < bpp && i < n; i++)
+         d[i] = row[i];
+      for (; i < n; i++)
+         d[i] = (png_byte)(row[i] - row[i - bpp]);
+      if ((cost = png_parallel_row_cost(d, n)) < best_cost)
+         best_cost = cost, best = PNG_FILTER_VALUE_SUB;
+   }
+
+   if ((filters & PNG_FILTER_UP) != 0)
+   {
+      png_bytep d = cand[PNG_FILTER_VALUE_UP] + 1;
+      for (i = 0; i < n; i++)
+         d[i] = (png_byte)(row[i] - prev[i]);
+      if ((cost = png_parallel_row_cost(d, n)) < best_cost)
+         best_cost = cost, best = PNG_FILTER_VALUE_UP;
+   }
+
+   if ((filters & PNG_FILTER_AVG) != 0)
+   {
+      png_bytep d = cand[PNG_FILTER_VALUE_AVG] + 1;
+      for (i = 0; i < bpp && i < n; i++)
+         d[i] = (png_byte)(row[i] - (prev[i] >> 1));
+      for (; i < n; i++)
+         d[i] = (png_byte)(row[i] - ((row[i - bpp] + prev[i]) >> 1));
+      if ((cost = png_parallel_row_cost(d, n)) < best_cost)
+         best_cost = cost, best = PNG_FILTER_VALUE_AVG;
+   }
+
+   if ((filters & PNG_FILTER_PAETH) != 0)
+   {
+      png_bytep d = cand[PNG_FILTER_VALUE_PAETH] + 1;
+      for (i = 0; i < bpp && i < n; i++)
+         d[i] = (png_byte)(row[i] - prev[i]);
+      for (; i < n; i++)
+      {
+         int a = row[i - bpp], b = prev[i], c = prev[i - bpp];
+         int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+         int pred = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+         d[i] = (png_byte)(row[i] - pred);
+      }
+      if ((cost = png_parallel_row_cost(d, n)) < best_cost)
+         best_cost = cost, best = PNG_FILTER_VALUE_PAETH;
+   }
+
+   if (best != PNG_FILTER_VALUE_NONE)
+   {
+      out[0] = (png_byte)best;
+      memcpy(out + 1, cand[best] + 1, n);
+   }
+}
+
+static inline int
+png_parallel_group_encode(png_parallel_job *job, png_uint_32 g, z_stream *strm)
+{
+   png_parallel_group *grp = &job->groups[g];
+   size_t stride = job->rowbytes + 1;
+   png_uint_32 dict_rows = (png_uint_32)((PNG_PARALLEL_WINDOW + stride - 1) / stride);
+   png_uint_32 first = grp->row0 > dict_rows ? grp->row0 - dict_rows : 0;
+   png_uint_32 y;
+   png_bytep buf, scratch, body;
+   size_t dict_len, bound;
+   int ret;
+
+   buf = (png_bytep)malloc((size_t)(grp->row1 - first) * stride + 4 * stride);
+   if (buf == NULL)
+      return Z_MEM_ERROR;
+   scratch = buf + (size_t)(grp->row1 - first) * stride;
+
+   for (y = first; y < grp->row1; y++)
+      png_parallel_filter_row(job, y ? job->rows[y - 1] : NULL, job->rows[y],
+          buf + (size_t)(y - first) * stride, scratch);
+
+   body = buf + (size_t)(grp->row0 - first) * stride;
+   dict_len = (size_t)(grp->row0 - first) * stride;
+   if (dict_len > PNG_PARALLEL_WINDOW)
+      dict_len = PNG_PARALLEL_WINDOW;
+   grp->raw_len = (size_t)(grp->row1 - grp->row0) * stride;
+   grp->adler = adler32_fast(adler32(0L, Z_NULL, 0), body, grp->raw_len);
+
+   bound = z_parallel_block_bound(grp->raw_len);
+   grp->out = (png_bytep)malloc(bound);
+   if (grp->out == NULL)
+   {
+      free(buf);
+      return Z_MEM_ERROR;
+   }
+
+   deflateReset(strm);
+   ret = dict_len != 0 ? deflateSetDictionary(strm, body - dict_len, (uInt)dict_len) : Z_OK;
+   if (ret == Z_OK)
+   {
+      int last = g == job->ngroups - 1;
+
+      strm->next_in = body;
+      strm->avail_in = (uInt)grp->raw_len;
+      strm->next_out = grp->out;
+      strm->avail_out = (uInt)bound;
+      ret = deflate(strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+      if (ret == (last ? Z_STREAM_END : Z_OK) && strm->avail_in == 0)
+         ret = Z_OK;
+      else if (ret == Z_OK || ret == Z_STREAM_END)
+         ret = Z_BUF_ERROR;
+      grp->out_len = bound - strm->avail_out;
+   }
+
+   free(buf);
+   return ret;
+}
+
+static inline void *
+png_parallel_worker(void *arg)
+{
+   png_parallel_job *job = (png_parallel_job *)arg;
+   z_stream strm;
+   png_uint_32 g;
+   int init;
+
+   memset(&strm, 0, sizeof strm);
+   init = deflateInit2(&strm, job->level, Z_DEFLATED, -15, 8, job->strategy);
+
+   while ((g = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->ngroups)
+      job->groups[g].err = init == Z_OK ? png_parallel_group_encode(job, g, &strm) : init;
+
+   if (init == Z_OK)
+      deflateEnd(&strm);
+   return NULL;
+}
+
+/* Write the image data and IEND.  Call after png_write_info(), instead of
+ * png_write_image() and png_write_end().
+ *
+ * filters is a PNG_FILTER_* mask, 0 for libpng's default (all filters for
+ * 8-bit and deeper non-palette images, none otherwise).  level is the zlib
+ * level, -1 for the default.  threads is the number of encoder threads, 0
+ * for one per online processor.  Errors go through png_error().
+ */
+static inline void
+png_write_image_parallel(png_structrp png_ptr, png_const_inforp info_ptr,
+    png_bytepp image, int filters, int level, int threads)
+{
+   static const png_byte png_IDAT[5] = { 73, 68, 65, 84, '\0' };
+   static const png_byte png_IEND[5] = { 73, 69, 78, 68, '\0' };
+   pthread_t tid[Z_PARALLEL_MAX_THREADS];
+   png_parallel_job job;
+   png_uint_32 width, height, g, rows_per_group;
+   int bit_depth, color_type, interlace, channels, started = 0, err = Z_OK;
+   uLong adler;
+   jmp_buf saved_jmpbuf;
+
+   if (png_ptr == NULL || info_ptr == NULL)
+      return;
+
+   png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
+       &interlace, NULL, NULL);
+   if (interlace != PNG_INTERLACE_NONE)
+      png_error(png_ptr, "png_write_image_parallel: interlacing not supported");
+   channels = png_get_channels(png_ptr, info_ptr);
+
+   memset(&job, 0, sizeof job);
+   job.rows = (png_const_bytep const *)image;
+   job.rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+   job.bpp = (unsigned int)((channels * bit_depth + 7) >> 3);
+   if (filters == 0)
+      filters = color_type == PNG_COLOR_TYPE_PALETTE || bit_depth < 8 ?
+          PNG_FILTER_NONE : PNG_ALL_FILTERS;
+   job.filters = filters;
+   job.level = level;
+   job.strategy = filters == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+
+   rows_per_group = (png_uint_32)(PNG_PARALLEL_GROUP_BYTES / (job.rowbytes + 1));
+   if (rows_per_group == 0)
+      rows_per_group = 1;
+   job.ngroups = (height + rows_per_group - 1) / rows_per_group;
+   job.groups = (png_parallel_group *)calloc(job.ngroups, sizeof *job.groups);
+   if (job.groups == NULL)
+      png_error(png_ptr, "png_write_image_parallel: out of memory");
+   for (g = 0; g < job.ngroups; g++)
+   {
+      job.groups[g].row0 = g * rows_per_group;
+      job.groups[g].row1 = g == job.ngroups - 1 ? height : (g + 1) * rows_per_group;
+   }
+
+   if (threads <= 0)
+      threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (threads < 1)
+      threads = 1;
+   if (threads > Z_PARALLEL_MAX_THREADS)
+      threads = Z_PARALLEL_MAX_THREADS;
+   if ((png_uint_32)threads > job.ngroups)
+      threads = (int)job.ngroups;
+   threads--;
+   for (; started < threads; started++)
+      if (pthread_create(&tid[started], NULL, png_parallel_worker, &job) != 0)
+         break;
+   /* the calling thread works too, and alone if no thread could start */
+   png_parallel_worker(&job);
+   for (g = 0; g < (png_uint_32)started; g++)
+      pthread_join(tid[g], NULL);
+
+   /* libpng reports write errors with longjmp, so it is only called once
+    * every worker has stopped.
+    */
+   for (g = 0; g < job.ngroups && err == Z_OK; g++)
+      err = job.groups[g].err;
+   if (err != Z_OK)
+   {
+      for (g = 0; g < job.ngroups; g++)
+         free(job.groups[g].out);
+      free(job.groups);
+      png_error(png_ptr, err == Z_MEM_ERROR ?
+          "png_write_image_parallel: out of memory" :
+          "png_write_image_parallel: zlib error");
+   }
+
+   /* A failing write callback longjmps out of png_write_chunk_*(): catch
+    * it here to free the unwritten groups, then pass it on to the caller's
+    * jmp_buf.
+    */
+   memcpy(saved_jmpbuf, png_jmpbuf(png_ptr), sizeof saved_jmpbuf);
+   if (setjmp(png_jmpbuf(png_ptr)))
+   {
+      memcpy(png_jmpbuf(png_ptr), saved_jmpbuf, sizeof saved_jmpbuf);
+      for (g = 0; g < job.ngroups; g++)
+         free(job.groups[g].out);
+      free(job.groups);
+      png_longjmp(png_ptr, 1);
+   }
+
+   adler = adler32(0L, Z_NULL, 0);
+   for (g = 0; g < job.ngroups; g++)
+   {
+      png_parallel_group *grp = &job.groups[g];
+
+      png_write_chunk_start(png_ptr, png_IDAT, (png_uint_32)(grp->out_len +
+          (g == 0 ? 2 : 0) + (g == job.ngroups - 1 ? 4 : 0)));
+      if (g == 0)
+      {
+         /* CMF: deflate, 32K window; FLG: FLEVEL as deflate() sets it */
+         int flevel = job.strategy >= Z_HUFFMAN_ONLY || (level >= 0 && level < 2) ?
+             0 : level >= 0 && level < 6 ? 1 : level < 0 || level == 6 ? 2 : 3;
+         unsigned int header = (0x78 << 8) | (unsigned int)(flevel << 6);
+         png_byte zhead[2];
+
+         header += 31 - (header % 31);
+         zhead[0] = (png_byte)(header >> 8);
+         zhead[1] = (png_byte)header;
+         png_write_chunk_data(png_ptr, zhead, 2);
+      }
+      png_write_chunk_data(png_ptr, grp->out, grp->out_len);
+      adler = adler32_combine(adler, grp->adler, (z_off_t)grp->raw_len);
+      free(grp->out);
+      grp->out = NULL;
+      if (g == job.ngroups - 1)
+      {
+         png_byte trailer[4];
+
+         trailer[0] = (png_byte)(adler >> 24);
+         trailer[1] = (png_byte)(adler >> 16);
+         trailer[2] = (png_byte)(adler >> 8);
+         trailer[3] = (png_byte)adler;
+         png_write_chunk_data(png_ptr, trailer, 4);
+      }
+      png_write_chunk_end(png_ptr);
+   }
+   memcpy(png_jmpbuf(png_ptr), saved_jmpbuf, sizeof saved_jmpbuf);
+   free(job.groups);
+
+   png_write_chunk(png_ptr, png_IEND, NULL, 0);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PNG_PARALLEL_H */
@@ -0,0 +1,315 @@
+/* zlib_checksum.h -- hardware-accelerated crc32() and adler32() for zlib
+
+  This software is provided 'as-is', without any express or implied
+  warranty.  In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the same restrictions as zlib itself (see zlib.h).
+*/
+
+/*
+     crc32_fast() and adler32_fast() return exactly what crc32_z() and
+   adler32_z() return for the same arguments, and can be used anywhere
+   those are: to check inflate() output, to checksum PNG chunks, or with
+   crc32_combine() and adler32_combine().
+
+     The fast paths are picked at run time on x86 (PCLMULQDQ folding for
+   CRC-32, SSSE3 for Adler-32) and at build time on ARMv8 (the CRC32
+   instructions and NEON).  Short buffers, unaligned tails and CPUs without
+   the extensions go to zlib's own functions.
+
+     zlib 1.2.11 calls its internal checksums from inflate() and deflate(),
+   and those cannot be replaced from outside the library.  To get the
+   speed-up there, inflate with windowBits negative (raw) and check the
+   stream with these functions, or use them on the output of inflate().
+*/
+
+#ifndef ZLIB_CHECKSUM_H
+#define ZLIB_CHECKSUM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "zlib.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define Z_CHECKSUM_X86
+#  include <immintrin.h>
+#elif defined(__aarch64__)
+#  if defined(__ARM_FEATURE_CRC32)
+#    define Z_CHECKSUM_ARM_CRC
+#    include <arm_acle.h>
+#  endif
+#  if defined(__ARM_NEON)
+#    define Z_CHECKSUM_NEON
+#    include <arm_neon.h>
+#  endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define Z_CHECKSUM_BASE 65521U  /* largest prime smaller than 65536 */
+#define Z_CHECKSUM_NMAX 5552    /* bytes before s2 can overflow 32 bits */
+
+#ifdef Z_CHECKSUM_X86
+
+/* Fold 64 bytes at a time with carry-less multiplies, then Barrett-reduce,
+   as in Intel's "Fast CRC Computation for Generic Polynomials Using
+   PCLMULQDQ".  crc is the inverted running value; len >= 64 and a multiple
+   of 16. */
+__attribute__((target("pclmul,sse4.1")))
+static inline uint32_t z_crc32_pclmul(uint32_t crc, const unsigned char *buf, z_size_t len)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    buf += 64;
+    len -= 64;
+
+    x0 = k1k2;
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = k3k4;
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)buf)), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 -> 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+/* Adler-32 over whole 32-byte blocks, len a multiple of 32. */
+__attribute__((target("ssse3")))
+static inline uLong z_adler32_ssse3(uLong adler, const unsigned char *buf, z_size_t len)
+{
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                       24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,
+                                       8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = (adler >> 16) & 0xffff;
+    z_size_t blocks = len / 32;
+
+    while (blocks) {
+        z_size_t n = Z_CHECKSUM_NMAX / 32;
+        __m128i v_ps, v_s1, v_s2;
+
+        if (n > blocks)
+            n = blocks;
+        blocks -= n;
+
+        /* 32-bit lanes may wrap; their sum is exact since NMAX keeps the
+           true s2 below 2^32 */
+        v_ps = _mm_set_epi32(0, 0, 0, (int)(s1 * n));
+        v_s2 = _mm_set_epi32(0, 0, 0, (int)s2);
+        v_s1 = zero;
+        do {
+            const __m128i b1 = _mm_loadu_si128((const __m128i *)buf);
+            const __m128i b2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b1, zero));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(b1, tap1), ones));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(b2, tap2), ones));
+            buf += 32;
+        } while (--n);
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 = (s1 + (uint32_t)_mm_cvtsi128_si32(v_s1)) % Z_CHECKSUM_BASE;
+        s2 = (uint32_t)_mm_cvtsi128_si32(v_s2) % Z_CHECKSUM_BASE;
+    }
+    return (uLong)(s2 << 16 | s1);
+}
+
+/* 0 unknown, 1 present, -1 absent */
+static int z_checksum_have_pclmul;
+static int z_checksum_have_ssse3;
+
+static inline int z_checksum_cpu(int *cache, int have)
+{
+    int v = __atomic_load_n(cache, __ATOMIC_RELAXED);
+    if (!v) {
+        v = have ? 1 : -1;
+        __atomic_store_n(cache, v, __ATOMIC_RELAXED);
+    }
+    return v > 0;
+}
+
+#endif /* Z_CHECKSUM_X86 */
+
+#ifdef Z_CHECKSUM_NEON
+
+/* Adler-32 over whole 16-byte blocks, len a multiple of 16. */
+static inline uLong z_adler32_neon(uLong adler, const unsigned char *buf, z_size_t len)
+{
+    static const uint8_t taps[16] = { 16, 15, 14, 13, 12, 11, 10, 9,
+                                      8, 7, 6, 5, 4, 3, 2, 1 };
+    const uint8x8_t tap_lo = vld1_u8(taps);
+    const uint8x8_t tap_hi = vld1_u8(taps + 8);
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = (adler >> 16) & 0xffff;
+    z_size_t blocks = len / 16;
+
+    while (blocks) {
+        z_size_t n = Z_CHECKSUM_NMAX / 16;
+        uint32x4_t v_ps, v_s1, v_s2;
+
+        if (n > blocks)
+            n = blocks;
+        blocks -= n;
+
+        v_ps = vsetq_lane_u32((uint32_t)(s1 * n), vdupq_n_u32(0), 0);
+        v_s2 = vsetq_lane_u32(s2, vdupq_n_u32(0), 0);
+        v_s1 = vdupq_n_u32(0);
+        do {
+            const uint8x16_t b = vld1q_u8(buf);
+            uint16x8_t w;
+
+            v_ps = vaddq_u32(v_ps, v_s1);
+            v_s1 = vpadalq_u16(v_s1, vpaddlq_u8(b));
+            w    = vmull_u8(vget_low_u8(b), tap_lo);
+            w    = vmlal_u8(w, vget_high_u8(b), tap_hi);
+            v_s2 = vpadalq_u16(v_s2, w);
+            buf += 16;
+        } while (--n);
+        v_s2 = vaddq_u32(v_s2, vshlq_n_u32(v_ps, 4));
+
+        s1 = (s1 + vaddvq_u32(v_s1)) % Z_CHECKSUM_BASE;
+        s2 = vaddvq_u32(v_s2) % Z_CHECKSUM_BASE;
+    }
+    return (uLong)(s2 << 16 | s1);
+}
+
+#endif /* Z_CHECKSUM_NEON */
+
+/*
+     Same as crc32_z().
+*/
+static inline uLong crc32_fast(uLong crc, const Bytef *buf, z_size_t len)
+{
+    if (buf == Z_NULL)
+        return 0UL;
+
+#if defined(Z_CHECKSUM_X86)
+    if (len >= 64 &&
+        z_checksum_cpu(&z_checksum_have_pclmul,
+                       __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))) {
+        z_size_t chunk = len & ~(z_size_t)15;
+        crc = ~z_crc32_pclmul(~(uint32_t)crc, buf, chunk) & 0xffffffffUL;
+        buf += chunk;
+        len -= chunk;
+    }
+#elif defined(Z_CHECKSUM_ARM_CRC)
+    {
+        uint32_t c = ~(uint32_t)crc;
+        while (len && ((uintptr_t)buf & 7)) {
+            c = __crc32b(c, *buf++);
+            len--;
+        }
+        for (; len >= 8; len -= 8, buf += 8) {
+            uint64_t v;
+            memcpy(&v, buf, 8);
+            c = __crc32d(c, v);
+        }
+        while (len--)
+            c = __crc32b(c, *buf++);
+        return ~c & 0xffffffffUL;
+    }
+#endif
+    return crc32_z(crc, buf, len);
+}
+
+/*
+     Same as adler32_z().
+*/
+static inline uLong adler32_fast(uLong adler, const Bytef *buf, z_size_t len)
+{
+    if (buf == Z_NULL)
+        return 1UL;
+
+#if defined(Z_CHECKSUM_X86)
+    if (len >= 64 && z_checksum_cpu(&z_checksum_have_ssse3, __builtin_cpu_supports("ssse3"))) {
+        z_size_t chunk = len & ~(z_size_t)31;
+        adler = z_adler32_ssse3(adler, buf, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+#elif defined(Z_CHECKSUM_NEON)
+    if (len >= 64) {
+        z_size_t chunk = len & ~(z_size_t)15;
+        adler = z_adler32_neon(adler, buf, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+#endif
+    return adler32_z(adler, buf, len);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZLIB_CHECKSUM_H */
@@ -0,0 +1,291 @@
+/* zlib_parallel.h -- multi-threaded deflate front-end for zlib
+
+  This software is provided 'as-is', without any express or implied
+  warranty.  In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the same restrictions as zlib itself (see zlib.h).
+*/
+
+/*
+     compressParallel() splits its input into blocks and compresses them on
+   several threads, the way pigz does.  Each block is raw-deflated on its
+   own, primed with the preceding window (32K by default) of input through
+   deflateSetDictionary(), so matches across block boundaries are still
+   found and the ratio stays within a fraction of a percent of compress2().
+   Every block but the last ends with a sync flush to land on a byte
+   boundary; the blocks are then concatenated behind a zlib or gzip header,
+   and the per-block checksums are merged with adler32_combine() or
+   crc32_combine() for the trailer.  The result is one ordinary zlib, gzip
+   or raw deflate stream that any inflate() can read.
+
+     Blocks are independent, so throughput scales with the number of
+   threads once the input spans a few blocks per thread.
+*/
+
+#ifndef ZLIB_PARALLEL_H
+#define ZLIB_PARALLEL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define Z_PARALLEL_BLOCK_DEFAULT (128L * 1024)
+#define Z_PARALLEL_MAX_THREADS   64
+
+typedef struct z_parallel_block_s {
+    const Bytef *in;
+    uLong       in_len;
+    const Bytef *dict;
+    uInt        dict_len;
+    Bytef       *out;
+    uLong       out_len;
+    uLong       check;
+    int         last;
+    int         err;
+} z_parallel_block;
+
+typedef struct z_parallel_job_s {
+    z_parallel_block *blocks;
+    uLong            nblocks;
+    uLong            next;          /* next block to take, atomic */
+    int              level;
+    int              windowBits;    /* as given to compressParallel() */
+    int              memLevel;
+    int              strategy;
+} z_parallel_job;
+
+/* upper bound of one block's raw deflate output including its flush */
+static inline uLong z_parallel_block_bound(uLong len)
+{
+    return len + (len >> 3) + (len >> 6) + 16;
+}
+
+static inline uLong z_parallel_block_size(uLong blockSize)
+{
+    return blockSize ? blockSize : Z_PARALLEL_BLOCK_DEFAULT;
+}
+
+/*
+     compressParallelBound() returns an upper bound on the size of the
+   output of compressParallel() for sourceLen bytes and the given block
+   size (0 for the default), including a zlib or gzip wrapper.
+*/
+static inline uLong compressParallelBound(uLong sourceLen, uLong blockSize)
+{
+    uLong block = z_parallel_block_size(blockSize);
+    uLong nblocks = sourceLen ? (sourceLen + block - 1) / block : 1;
+
+    return sourceLen + (sourceLen >> 3) + (sourceLen >> 6) + nblocks * 16 + 18;
+}
+
+static inline void *z_parallel_worker(void *arg)
+{
+    z_parallel_job *job = (z_parallel_job *)arg;
+    int gzip = job->windowBits > 15;
+    int wbits = gzip ? job->windowBits - 16 :
+                job->windowBits < 0 ? -job->windowBits : job->windowBits;
+    z_stream strm;
+    uLong i;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, job->level, Z_DEFLATED, -wbits, job->memLevel,
+                       job->strategy);
+
+    for (;;) {
+        z_parallel_block *b;
+
+        i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->nblocks)
+            break;
+        b = &job->blocks[i];
+        if (ret != Z_OK) {
+            b->err = ret;
+            continue;
+        }
+
+        b->out = (Bytef *)malloc(z_parallel_block_bound(b->in_len));
+        if (b->out == Z_NULL) {
+            b->err = Z_MEM_ERROR;
+            continue;
+        }
+        if (job->windowBits >= 0)
+            b->check = gzip ? crc32(crc32(0L, Z_NULL, 0), b->in, (uInt)b->in_len) :
+                              adler32(adler32(0L, Z_NULL, 0), b->in, (uInt)b->in_len);
+
+        deflateReset(&strm);
+        if (b->dict_len && (b->err = deflateSetDictionary(&strm, b->dict, b->dict_len)) != Z_OK)
+            continue;
+        strm.next_in = (z_const Bytef *)b->in;
+        strm.avail_in = (uInt)b->in_len;
+        strm.next_out = b->out;
+        strm.avail_out = (uInt)z_parallel_block_bound(b->in_len);
+        b->err = deflate(&strm, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (b->err == (b->last ? Z_STREAM_END : Z_OK) && strm.avail_in == 0)
+            b->err = Z_OK;
+        else if (b->err == Z_OK || b->err == Z_STREAM_END)
+            b->err = Z_BUF_ERROR;
+        b->out_len = strm.total_out;
+    }
+
+    if (ret == Z_OK)
+        deflateEnd(&strm);
+    return NULL;
+}
+
+/*
+     compressParallel() compresses sourceLen bytes of source into dest with
+   up to threads threads (0 for one per online processor).  Upon entry,
+   destLen is the size of dest, which should be at least
+   compressParallelBound(sourceLen, blockSize); upon exit it is the size of
+   the compressed stream.
+
+     level, memLevel and strategy are as for deflateInit2().  windowBits
+   selects the wrapper as for deflateInit2(): 9..15 for zlib, 25..31 for
+   gzip, -9..-15 for raw deflate; it also sets the dictionary carried from
+   one block to the next.  blockSize is the input per block, 0 for the
+   default of 128K; blocks smaller than 32K cost ratio.
+
+     Blocks of at most 4G are required since the checksums are computed with
+   one crc32() or adler32() call per block.
+
+     compressParallel returns Z_OK if success, Z_MEM_ERROR if there was not
+   enough memory, Z_BUF_ERROR if there was not enough room in the output
+   buffer, Z_STREAM_ERROR if a parameter is invalid.
+*/
+static inline int compressParallel(Bytef *dest, uLongf *destLen,
+                                   const Bytef *source, uLong sourceLen,
+                                   int level, int windowBits, int memLevel,
+                                   int strategy, uLong blockSize, int threads)
+{
+    pthread_t tid[Z_PARALLEL_MAX_THREADS];
+    z_parallel_job job;
+    uLong block, i, pos, check, total = 0;
+    int gzip = windowBits > 15, raw = windowBits < 0;
+    int wbits = gzip ? windowBits - 16 : raw ? -windowBits : windowBits;
+    int nthreads, started = 0, ret = Z_OK;
+
+    if (wbits < 9 || wbits > 15 || level < Z_DEFAULT_COMPRESSION || level > 9)
+        return Z_STREAM_ERROR;
+    if (level == Z_DEFAULT_COMPRESSION)
+        level = 6;
+    block = z_parallel_block_size(blockSize);
+    if (block > 0xffffffffUL)
+        return Z_STREAM_ERROR;
+
+    memset(&job, 0, sizeof(job));
+    job.nblocks = sourceLen ? (sourceLen + block - 1) / block : 1;
+    job.level = level;
+    job.windowBits = windowBits;
+    job.memLevel = memLevel;
+    job.strategy = strategy;
+    job.blocks = (z_parallel_block *)calloc(job.nblocks, sizeof(z_parallel_block));
+    if (job.blocks == Z_NULL)
+        return Z_MEM_ERROR;
+    for (i = 0, pos = 0; i < job.nblocks; i++, pos += block) {
+        z_parallel_block *b = &job.blocks[i];
+        uLong dict = pos < (1UL << wbits) ? pos : (1UL << wbits);
+        b->in = source + pos;
+        b->in_len = sourceLen - pos < block ? sourceLen - pos : block;
+        b->dict = source + pos - dict;
+        b->dict_len = (uInt)dict;
+        b->last = i == job.nblocks - 1;
+    }
+
+    nthreads = threads > 0 ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > Z_PARALLEL_MAX_THREADS)
+        nthreads = Z_PARALLEL_MAX_THREADS;
+    if ((uLong)nthreads > job.nblocks)
+        nthreads = (int)job.nblocks;
+    /* the calling thread is one of the workers */
+    for (; started < nthreads - 1; started++)
+        if (pthread_create(&tid[started], NULL, z_parallel_worker, &job))
+            break;
+    z_parallel_worker(&job);
+    for (i = 0; i < (uLong)started; i++)
+        pthread_join(tid[i], NULL);
+
+    /* header */
+    if (!raw) {
+        uLong need = gzip ? 10 : 2;
+        if (*destLen < need) {
+            ret = Z_BUF_ERROR;
+            goto done;
+        }
+        if (gzip) {
+            static const Bytef head[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+            memcpy(dest, head, 10);
+            dest[8] = level == 9 ? 2 : level == 1 ? 4 : 0;
+        } else {
+            /* same FLEVEL choice as deflate() */
+            uInt flags = strategy >= Z_HUFFMAN_ONLY || level < 2 ? 0 :
+                         level < 6 ? 1 : level == 6 ? 2 : 3;
+            uInt header = ((Z_DEFLATED + ((wbits - 8) << 4)) << 8) | (flags << 6);
+            header += 31 - (header % 31);
+            dest[0] = (Bytef)(header >> 8);
+            dest[1] = (Bytef)header;
+        }
+        total = need;
+    }
+
+    /* body and checksum */
+    check = gzip ? crc32(0L, Z_NULL, 0) : adler32(0L, Z_NULL, 0);
+    for (i = 0; i < job.nblocks; i++) {
+        z_parallel_block *b = &job.blocks[i];
+        if (b->err != Z_OK) {
+            ret = b->err;
+            goto done;
+        }
+        if (*destLen - total < b->out_len) {
+            ret = Z_BUF_ERROR;
+            goto done;
+        }
+        memcpy(dest + total, b->out, b->out_len);
+        total += b->out_len;
+        if (!raw)
+            check = gzip ? crc32_combine(check, b->check, (z_off_t)b->in_len) :
+                           adler32_combine(check, b->check, (z_off_t)b->in_len);
+    }
+
+    /* trailer */
+    if (!raw) {
+        if (*destLen - total < (gzip ? 8UL : 4UL)) {
+            ret = Z_BUF_ERROR;
+            goto done;
+        }
+        if (gzip) {
+            for (i = 0; i < 4; i++)
+                dest[total++] = (Bytef)(check >> (8 * i));
+            for (i = 0; i < 4; i++)
+                dest[total++] = (Bytef)(sourceLen >> (8 * i));
+        } else {
+            for (i = 0; i < 4; i++)
+                dest[total++] = (Bytef)(check >> (24 - 8 * i));
+        }
+    }
+    *destLen = total;
+
+done:
+    for (i = 0; i < job.nblocks; i++)
+        free(job.blocks[i].out);
+    free(job.blocks);
+    return ret;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZLIB_PARALLEL_H */